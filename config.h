@@ -0,0 +1,9 @@
+#ifndef NETEVENT_2_CONFIG_H
+#define NETEVENT_2_CONFIG_H
+
+#define NETEVENT_VERSION "2.2.3"
+#define HAS_UI_DEV_SETUP
+#define HAS_IO_URING
+#define HAS_TLS
+
+#endif
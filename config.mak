@@ -0,0 +1,10 @@
+PREFIX = /usr/local
+BINDIR = /usr/local/bin
+DATAROOTDIR = /usr/local/share
+MANDIR = /usr/local/share/man
+MAN1DIR = /usr/local/share/man/man1
+ENABLE_DOC = 
+RST2MAN = 
+CXX = g++
+SOURCEDIR = /root/repo
+TLS_LIBS = -lssl -lcrypto 
@@ -5,21 +5,35 @@
  *
  * SPDX-License-Identifier: GPL-2.0-or-later
  */
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <poll.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
+using std::deque;
 using std::vector;
 using std::map;
 
 #include "main.h"
+#include "ne3.h"
+#include "uring.h"
+#include "tls.h"
+#include "spsc.h"
 
 #pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
 
@@ -36,25 +50,599 @@ usage_daemon [[noreturn]] (FILE *out, int exit_status)
 "options:\n"
 "  -h, --help             show this help message\n"
 "  -s, --source=FILE      run commands from FILE on startup\n"
+"      --io-uring         use io_uring instead of epoll for the main loop\n"
+"      --threads          read each device on its own thread and serve\n"
+"                         commands on another\n"
+"      --realtime[=POLICY[:PRIO]]\n"
+"                         use real-time scheduling (fifo or rr, default fifo:10)\n"
+"      --cpu=LIST         pin to the listed cpus, eg. 0,2-3\n"
+"      --mlock            lock all memory to avoid page faults\n"
 );
 	::exit(exit_status);
 }
 
 struct FDCallbacks {
 	function<void()> onRead;
+	function<void()> onWrite;
 	function<void()> onHUP;
 	function<void()> onError;
 	function<void()> onRemove;
 };
 
+// With io_uring, devices are read straight into their event buffer instead
+// of waiting for readability first.
+struct DirectRead {
+	Span<uint8_t> buffer;
+	function<void(ssize_t)> onDone;
+};
+
+struct FDEntry {
+	FDCallbacks cbs;
+	DirectRead direct;
+	// io_uring: completion of a write submitted for this fd
+	function<void(ssize_t)> onWriteDone;
+	int fd;
+	uint32_t events;
+	// set by removeFD() so pending events are not dispatched anymore
+	bool removing;
+	// io_uring: operations the kernel still holds a pointer to us for
+	unsigned inflight;
+};
+
 struct Command {
 	int    client_;
 	string command_;
 };
 
+// With --threads every device is read on its own thread, so a burst on one
+// device cannot delay the events of another. The events are passed to the
+// main loop through a lock-free queue, and notify_ wakes it up. Commands are
+// kept off the main loop by the ControlThread.
+struct DeviceReader {
+	static const size_t kQueueSize = 4096;
+
+	DeviceReader() = delete;
+	DeviceReader(const DeviceReader&) = delete;
+	explicit DeviceReader(InDevice& device);
+	~DeviceReader();
+
+	int fd() const noexcept {
+		return notify_.fd();
+	}
+	SPSCQueue<InputEvent>& queue() noexcept {
+		return queue_;
+	}
+	void consumed(size_t count);
+
+	// Set when the thread gave up, the queue still needs to be drained.
+	bool failed() const noexcept {
+		return failed_.load(std::memory_order_acquire);
+	}
+	const string& error() const noexcept {
+		return error_;
+	}
+
+ private:
+	void run();
+	bool waitFor(int fd);
+	void push(Span<const InputEvent> events);
+
+ private:
+	InDevice& device_;
+	SPSCQueue<InputEvent> queue_;
+	IOHandle notify_;
+	IOHandle wake_;
+	std::atomic<bool> stop_ { false };
+	std::atomic<bool> waiting_ { false };
+	std::atomic<bool> failed_ { false };
+	string error_;
+	std::thread thread_;
+};
+
+DeviceReader::DeviceReader(InDevice& device)
+	: device_(device)
+	, queue_(kQueueSize)
+	, notify_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	, wake_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+	if (!notify_ || !wake_)
+		throw ErrnoException("failed to create eventfd");
+	thread_ = std::thread([this]() { run(); });
+}
+
+DeviceReader::~DeviceReader()
+{
+	stop_.store(true);
+	(void)::eventfd_write(wake_.fd(), 1);
+	thread_.join();
+}
+
+void
+DeviceReader::run()
+{
+	try {
+		while (waitFor(device_.fd()))
+			push(device_.readBatch());
+	} catch (const std::exception& ex) {
+		error_ = ex.what();
+		failed_.store(true, std::memory_order_release);
+		(void)::eventfd_write(notify_.fd(), 1);
+	}
+}
+
+// Wait for the fd to become readable, or just for a wakeup if it is -1.
+// Returns false if the thread should stop.
+bool
+DeviceReader::waitFor(int fd)
+{
+	struct pollfd pfds[2] = {
+		{ wake_.fd(), POLLIN, 0 },
+		{ fd, POLLIN, 0 },
+	};
+	while (true) {
+		if (::poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw ErrnoException("poll failed");
+		}
+		if (pfds[0].revents) {
+			eventfd_t value;
+			(void)::eventfd_read(wake_.fd(), &value);
+		}
+		if (stop_.load())
+			return false;
+		if (fd < 0 || pfds[1].revents)
+			return true;
+	}
+}
+
+void
+DeviceReader::push(Span<const InputEvent> events)
+{
+	const InputEvent *data = events.data();
+	size_t count = events.size();
+	while (true) {
+		size_t pushed = queue_.push(data, count);
+		if (pushed)
+			(void)::eventfd_write(notify_.fd(), 1);
+		data += pushed;
+		count -= pushed;
+		if (!count)
+			return;
+
+		// The main loop wakes us up once it made room.
+		waiting_.store(true);
+		if (queue_.full() && !waitFor(-1))
+			return;
+		waiting_.store(false);
+	}
+}
+
+void
+DeviceReader::consumed(size_t count)
+{
+	queue_.release(count);
+	if (waiting_.exchange(false))
+		(void)::eventfd_write(wake_.fd(), 1);
+}
+
+// With --threads the main loop is left with forwarding events and serving
+// the outputs. Command clients are served on this thread and the lines they
+// send are queued up for the main loop, which sends its replies back the same
+// way. Foreground `exec` commands are waited for here as well, the rest of
+// their command line is queued once they are done. This way neither a slow
+// client nor a hotkey script can hold up any device.
+struct ControlThread {
+	ControlThread() = delete;
+	ControlThread(const ControlThread&) = delete;
+	explicit ControlThread(Socket& server);
+	~ControlThread();
+
+	// readable when commands are waiting for the main loop
+	int fd() const noexcept {
+		return notify_.fd();
+	}
+	void takeCommands(vector<Command>& into);
+	void reply(int client, string text);
+	// The main loop is done with a command line of the client.
+	void finished(int client);
+	void waitFor(pid_t pid, int client, string rest);
+
+ private:
+	struct Client {
+		IOHandle fd_;
+		string line_;
+		// command lines not finished yet
+		size_t pending_;
+		bool eof_;
+	};
+	struct Reply {
+		int client_;
+		string text_;
+		// change of the client's pending command lines
+		int pending_;
+	};
+	struct Child {
+		pid_t pid_;
+		IOHandle pidfd_;
+		int client_;
+		string rest_;
+	};
+
+	void run();
+	void newClient();
+	void readClient(int id);
+	void flushReplies();
+	void reapChildren();
+	void queueCommand(int client, string line);
+	void release(int client);
+	void wake();
+
+ private:
+	Socket& server_;
+	IOHandle notify_;
+	IOHandle wake_;
+	std::atomic<bool> stop_ { false };
+	std::mutex mutex_;
+	vector<Command> commands_;
+	vector<Reply> replies_;
+	vector<Child> newChildren_;
+	// only touched by the thread
+	map<int, Client> clients_;
+	vector<Child> children_;
+	int nextClient_ = 0;
+	std::thread thread_;
+};
+
+ControlThread::ControlThread(Socket& server)
+	: server_(server)
+	, notify_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	, wake_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+	if (!notify_ || !wake_)
+		throw ErrnoException("failed to create eventfd");
+	thread_ = std::thread([this]() { run(); });
+}
+
+ControlThread::~ControlThread()
+{
+	stop_.store(true);
+	wake();
+	thread_.join();
+}
+
+void
+ControlThread::wake()
+{
+	(void)::eventfd_write(wake_.fd(), 1);
+}
+
+void
+ControlThread::takeCommands(vector<Command>& into)
+{
+	eventfd_t value;
+	(void)::eventfd_read(notify_.fd(), &value);
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& command : commands_)
+		into.emplace_back(std::move(command));
+	commands_.clear();
+}
+
+void
+ControlThread::reply(int client, string text)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		replies_.emplace_back(Reply { client, std::move(text), 0 });
+	}
+	wake();
+}
+
+void
+ControlThread::finished(int client)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		replies_.emplace_back(Reply { client, string(), -1 });
+	}
+	wake();
+}
+
+// Without pidfds (before Linux 5.3) children are checked for periodically.
+void
+ControlThread::waitFor(pid_t pid, int client, string rest)
+{
+	int pidfd = -1;
+#ifdef SYS_pidfd_open
+	pidfd = int(::syscall(SYS_pidfd_open, pid, 0));
+#endif
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// keep the client around until the child is done
+		if (client >= 0)
+			replies_.emplace_back(Reply { client, string(), 1 });
+		newChildren_.emplace_back(Child {
+			pid, IOHandle { pidfd }, client, std::move(rest)
+		});
+	}
+	wake();
+}
+
+void
+ControlThread::queueCommand(int client, string line)
+{
+	auto iter = clients_.find(client);
+	if (iter != clients_.end())
+		++iter->second.pending_;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		commands_.emplace_back(Command { client, std::move(line) });
+	}
+	(void)::eventfd_write(notify_.fd(), 1);
+}
+
+void
+ControlThread::release(int id)
+{
+	auto iter = clients_.find(id);
+	if (iter != clients_.end() && !--iter->second.pending_ &&
+	    iter->second.eof_)
+		clients_.erase(iter);
+}
+
+void
+ControlThread::newClient()
+{
+	IOHandle fd = server_.accept();
+	int id = nextClient_++;
+	clients_.emplace(id, Client { std::move(fd), string(), 0, false });
+}
+
+void
+ControlThread::readClient(int id)
+{
+	Client& client = clients_.at(id);
+	char buf[4096];
+	ssize_t got = ::read(client.fd_.fd(), buf, sizeof(buf));
+	if (got < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (got <= 0) {
+		if (got < 0)
+			::fprintf(stderr,
+			          "error reading from command client: %s\n",
+			          ::strerror(errno));
+		client.eof_ = true;
+		// the last line does not need a newline
+		if (!client.line_.empty())
+			queueCommand(id, std::move(client.line_));
+		if (!client.pending_)
+			clients_.erase(id);
+		return;
+	}
+	client.line_.append(buf, size_t(got));
+	size_t end;
+	while ((end = client.line_.find('\n')) != string::npos) {
+		string line = client.line_.substr(0, end + 1);
+		client.line_.erase(0, end + 1);
+		queueCommand(id, std::move(line));
+	}
+}
+
+void
+ControlThread::flushReplies()
+{
+	vector<Reply> replies;
+	vector<Child> children;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		replies.swap(replies_);
+		children.swap(newChildren_);
+	}
+	for (auto& child : children)
+		children_.emplace_back(std::move(child));
+	for (const auto& reply : replies) {
+		auto iter = clients_.find(reply.client_);
+		// gone already
+		if (iter == clients_.end())
+			continue;
+		Client& client = iter->second;
+		const string& text = reply.text_;
+		if (!text.empty() &&
+		    ::write(client.fd_.fd(), text.data(), text.length()) !=
+		    ssize_t(text.length()))
+		{
+			::fprintf(stderr, "failed to write response to"
+			                  " client command\n");
+			clients_.erase(iter);
+			continue;
+		}
+		if (reply.pending_ > 0)
+			++client.pending_;
+		else if (reply.pending_ < 0)
+			release(reply.client_);
+	}
+}
+
+void
+ControlThread::reapChildren()
+{
+	for (auto i = children_.begin(); i != children_.end();) {
+		int status = 0;
+		pid_t got = ::waitpid(i->pid_, &status, WNOHANG);
+		// ECHILD: the SIGCHLD handler was faster
+		if (got == 0 || (got < 0 && errno == EINTR)) {
+			++i;
+			continue;
+		}
+		auto client = clients_.find(i->client_);
+		if (client != clients_.end())
+			(void)::write(client->second.fd_.fd(), "Ok.\n", 4);
+		if (!i->rest_.empty())
+			queueCommand(i->client_, std::move(i->rest_));
+		if (client != clients_.end())
+			release(i->client_);
+		i = children_.erase(i);
+	}
+}
+
+void
+ControlThread::run()
+{
+	// the children are waited for here
+	sigset_t sigchld;
+	::sigemptyset(&sigchld);
+	::sigaddset(&sigchld, SIGCHLD);
+	(void)::pthread_sigmask(SIG_UNBLOCK, &sigchld, nullptr);
+
+	vector<struct pollfd> pfds;
+	vector<int> ids;
+	while (!stop_.load()) {
+		flushReplies();
+		reapChildren();
+
+		pfds.clear();
+		ids.clear();
+		pfds.push_back({ wake_.fd(), POLLIN, 0 });
+		pfds.push_back({ server_.fd(), POLLIN, 0 });
+		for (const auto& i : clients_) {
+			if (i.second.eof_)
+				continue;
+			pfds.push_back({ i.second.fd_.fd(), POLLIN, 0 });
+			ids.push_back(i.first);
+		}
+		int timeout = -1;
+		for (const auto& child : children_) {
+			if (child.pidfd_)
+				pfds.push_back({ child.pidfd_.fd(), POLLIN, 0 });
+			else
+				timeout = 10;
+		}
+
+		if (::poll(pfds.data(), pfds.size(), timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			::fprintf(stderr, "control thread: poll failed: %s\n",
+			          ::strerror(errno));
+			return;
+		}
+		if (pfds[0].revents) {
+			eventfd_t value;
+			(void)::eventfd_read(wake_.fd(), &value);
+		}
+		if (pfds[1].revents) {
+			try {
+				newClient();
+			} catch (const Exception& ex) {
+				::fprintf(stderr, "%s\n", ex.what());
+			}
+		}
+		for (size_t i = 0; i != ids.size(); ++i) {
+			if (pfds[i + 2].revents)
+				readClient(ids[i]);
+		}
+	}
+}
+
+struct Output;
+
 struct Input {
 	uint16_t id_;
 	uniq<InDevice> device_;
+	// events of the current frame waiting for their SYN_REPORT
+	vector<InputEvent> frame_;
+	// output set via 'device route', otherwise the current output is used
+	string route_;
+	Output *routeOutput_;
+	// declared last so the thread is gone before the device
+	uniq<DeviceReader> reader_;
+
+	// the fd the main loop waits on for this input
+	int fd() const noexcept {
+		return reader_ ? reader_->fd() : device_->fd();
+	}
+};
+
+enum class OverflowPolicy {
+	Block,      // wait for the output (the old behavior)
+	DropOldest, // drop the oldest queued event frames
+	DropOutput, // give up on the output
+};
+
+static const size_t kDefaultOutputQueueSize = 64 * 1024;
+
+struct OutputChunk {
+	vector<uint8_t> data_;
+	size_t sent_;
+	// event frames may be dropped, device announcements may not
+	bool droppable_;
+};
+
+// keepalive echoes the receiver's clock offset is estimated from
+static const size_t kClockSamples = 8;
+
+struct Output {
+	string name_;
+	IOHandle handle_;
+	OverflowPolicy overflow_;
+	size_t queueLimit_;
+	// data the output did not accept yet
+	deque<OutputChunk> queue_;
+	size_t queued_ = 0;
+	size_t dropped_ = 0;
+	// Frames were dropped, possibly releasing keys, the receiver gets the
+	// current device state once the queue drained.
+	bool stateLost_ = false;
+	bool pollout_ = false;
+	bool failed_ = false;
+	// protocol version of the stream, see kNE3Version
+	uint16_t protocol_ = kNE2Version;
+	// kNE2Feature* flags the receiver asked for
+	uint16_t features_ = 0;
+	// no protocol was forced, the receiver picks one
+	bool negotiate_ = false;
+	bool tls_ = false;
+	bool tlsResumed_ = false;
+	// socket outputs get read to hear back from the receiver
+	bool listening_ = false;
+	vector<uint8_t> received_;
+	// TCP: receiving data clears TCP_QUICKACK
+	bool tcp_ = false;
+	// UDP: every write is a datagram, see NE2DatagramHeader
+	bool datagram_ = false;
+	uint32_t datagramSeq_ = 0;
+	uint64_t resyncedAt_ = 0;
+	// keepalives sent and the last one echoed by the receiver
+	uint32_t keepAliveSent_ = 0;
+	uint32_t keepAliveAnswered_ = 0;
+	// round trip times of the echoed keepalives in nanoseconds
+	struct {
+		uint64_t last;
+		uint64_t min;
+		uint64_t max;
+		uint64_t total;
+		uint64_t count;
+	} rtt_ = {};
+	// the receiver's clock offset (ours minus theirs) as seen by the last
+	// few echoes, the one with the shortest round trip is the most
+	// accurate
+	struct {
+		uint64_t rtt;
+		int64_t offset;
+	} clockSamples_[kClockSamples] = {};
+	size_t clockSampleCount_ = 0;
+	int64_t clockOffset_ = 0;
+	// since when queued data has been waiting without any progress, and
+	// since when an echo of a keepalive has, 0 if nothing is waiting
+	uint64_t stalledSince_ = 0;
+	uint64_t awaitingSince_ = 0;
+	// io_uring: the chunks at the front of the queue handed to the kernel
+	FDEntry *entry_ = nullptr;
+	size_t writing_ = 0;
+	struct iovec iov_[16];
+
+	int fd() const noexcept {
+		return handle_.fd();
+	}
 };
 
 struct FILEHandle {
@@ -88,20 +676,77 @@ struct HotkeyDef {
 #pragma clang diagnostic ignored "-Wexit-time-destructors"
 #pragma clang diagnostic ignored "-Wglobal-constructors"
 static bool                  gQuit = false;
+static IOHandle              gEpoll;
 static vector<int>           gFDRemoveQueue;
-static vector<struct pollfd> gFDAddQueue;
-static map<int, FDCallbacks> gFDCBs;
+// The epoll registrations and io_uring operations point directly to these,
+// lookups by fd only happen when adding, modifying or removing an fd.
+static map<int, uniq<FDEntry>> gFDEntries;
+#ifdef HAS_IO_URING
+static uniq<URing>           gURing;
+// completions which arrived while waiting for something specific
+static vector<struct io_uring_cqe> gDeferredCQEs;
+#endif
 static map<int, FILEHandle>  gCommandClients;
 static vector<Command>       gCommandQueue;
 static vector<uint16_t>      gInputIDFreeList;
 static map<string, Input>    gInputs;
-static map<string, IOHandle> gOutputs;
+static map<string, Output>   gOutputs;
 static struct {
 	int fd = -1;
+	Output *output = nullptr;
 	string name;
 }                            gCurrentOutput;
+// outputs receiving all events in addition to the current one
+static vector<Output*>       gMirrorOutputs;
+#ifdef HAS_TLS
+// by certificate, key and CA, so reconnecting outputs resume their sessions
+static map<string, std::shared_ptr<TLSContext>> gTLSContexts;
+// tls: outputs are only added once their handshake is done, until then they
+// wait here along with what they were added with.
+struct PendingOutput {
+	TLSHandshake handshake_;
+	bool skipAnnounce_;
+	OverflowPolicy overflow_;
+	size_t queueSize_;
+	uint16_t protocol_;
+	// `use` came before the handshake was done
+	bool use_;
+};
+static map<string, PendingOutput> gPendingOutputs;
+#endif
 static bool                  gWrite = false;
 static bool                  gGrab = false;
+static bool                  gFrameBatching = true;
+static bool                  gThreaded = false;
+static uniq<ControlThread>   gControl;
+// `exec` in files being sourced keeps waiting, see deferCommand()
+static unsigned              gSourceDepth = 0;
+static struct {
+	// spin budget in microseconds, 0 disables busy polling
+	unsigned long budget = 0;
+	// whether the current events were found while spinning
+	bool spinning = false;
+	uint64_t enabledAt = 0;
+	uint64_t spinTime = 0;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	// time from the event's timestamp until we forwarded it,
+	// [0] after sleeping, [1] after spinning
+	struct {
+		uint64_t count;
+		uint64_t total;
+	} latency[2] = {};
+}                            gBusyPoll;
+static struct {
+	IOHandle timer;
+	// seconds between keepalive packets, 0 disables them
+	unsigned long interval = 0;
+}                            gKeepAlive;
+static struct {
+	IOHandle timer;
+	// milliseconds an output may stall before it is dropped, 0 disables
+	unsigned long timeout = 0;
+}                            gOutputTimeout;
 static map<HotkeyDef, string> gHotkeys;
 static map<string, string>   gEventCommands;
 #pragma clang diagnostic pop
@@ -117,12 +762,29 @@ vectorRemove(vector<T>& vec, T&& value)
 }
 #endif
 
+static inline bool
+usingURing()
+{
+#ifdef HAS_IO_URING
+	return bool(gURing);
+#else
+	return false;
+#endif
+}
+
 static void parseClientCommand(int clientfd, const char *cmd, size_t length);
+static void processCommandQueue();
+static void sendDeviceStates(Output& out);
 
 static void
 daemon_preExec()
 {
-	gFDCBs.clear();
+	gFDEntries.clear();
+	// see cmd_daemon()
+	sigset_t none;
+	::sigemptyset(&none);
+	(void)::sigprocmask(SIG_SETMASK, &none, nullptr);
+	SchedOptions::resetChild();
 }
 
 #if 0
@@ -136,18 +798,259 @@ mapRemove(map<T,U>& m, T key)
 }
 #endif
 
+#ifdef HAS_IO_URING
+// io_uring completions carry the FDEntry pointer with the operation in its
+// low bits.
+enum : uint64_t {
+	kOpPoll     = 0,
+	kOpRead     = 1,
+	kOpWrite    = 2,
+	kOpCancel   = 3,
+	// an output is writable again after a write returned EAGAIN
+	kOpWritable = 4,
+	kOpMask     = 7,
+};
+
+static inline uint64_t
+uringData(FDEntry *entry, uint64_t op)
+{
+	return uint64_t(reinterpret_cast<uintptr_t>(entry)) | op;
+}
+
+static inline FDEntry*
+uringEntry(uint64_t data)
+{
+	return reinterpret_cast<FDEntry*>(uintptr_t(data & ~uint64_t(kOpMask)));
+}
+
+// Polls are one-shot, so this happens again after every completion.
+static void
+uringArm(FDEntry *entry)
+{
+	if (entry->direct.onDone) {
+		gURing->read(entry->fd, entry->direct.buffer.data(),
+		             entry->direct.buffer.size(),
+		             uringData(entry, kOpRead));
+	} else {
+		gURing->pollAdd(entry->fd, entry->events,
+		                uringData(entry, kOpPoll));
+	}
+	++entry->inflight;
+}
+#endif
+
+static FDEntry*
+addFD(int fd, FDCallbacks cbs, uint32_t events = EPOLLIN,
+      DirectRead direct = {})
+{
+	auto& slot = gFDEntries[fd];
+	slot.reset(new FDEntry {
+		std::move(cbs), std::move(direct), nullptr, fd, events, false, 0
+	});
+	FDEntry *entry = slot.get();
+#ifdef HAS_IO_URING
+	if (gURing) {
+		// Outputs only get polled while they have something queued.
+		if (events || entry->direct.onDone)
+			uringArm(entry);
+		return entry;
+	}
+#endif
+	struct epoll_event ev;
+	::memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = entry;
+	if (::epoll_ctl(gEpoll.fd(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+		gFDEntries.erase(fd);
+		throw ErrnoException("failed to add fd to epoll");
+	}
+	return entry;
+}
+
+static void
+modifyFD(int fd, uint32_t events)
+{
+	auto entry = gFDEntries.find(fd);
+	if (entry == gFDEntries.end() || entry->second->removing)
+		return;
+	entry->second->events = events;
+#ifdef HAS_IO_URING
+	// picked up when the poll is armed again
+	if (gURing)
+		return;
+#endif
+	struct epoll_event ev;
+	::memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = entry->second.get();
+	if (::epoll_ctl(gEpoll.fd(), EPOLL_CTL_MOD, fd, &ev) != 0)
+		throw ErrnoException("failed to modify epoll fd");
+}
+
 static void
 removeFD(int fd)
 {
 	if (fd < 0)
 		return;
-	if (std::find(gFDRemoveQueue.begin(), gFDRemoveQueue.end(), fd)
-	    == gFDRemoveQueue.end())
-	{
-		gFDRemoveQueue.push_back(fd);
+	auto entry = gFDEntries.find(fd);
+	if (entry == gFDEntries.end() || entry->second->removing)
+		return;
+	entry->second->removing = true;
+	// The fd stays open until the onRemove callback is done, so this
+	// can only fail if epoll is gone already.
+	// With io_uring the pending operations are cancelled in
+	// processRemoveQueue().
+	if (gEpoll)
+		(void)::epoll_ctl(gEpoll.fd(), EPOLL_CTL_DEL, fd, nullptr);
+	gFDRemoveQueue.push_back(fd);
+}
+
+static bool
+isRemoving(int fd)
+{
+	auto entry = gFDEntries.find(fd);
+	return entry == gFDEntries.end() || entry->second->removing;
+}
+
+// Returns false if the daemon should quit.
+static bool
+dispatchEvents(FDEntry *entry, uint32_t revents)
+{
+	auto& cbs = entry->cbs;
+	if (revents & EPOLLERR)
+		cbs.onError();
+	if (gQuit) return false;
+	if (revents & EPOLLHUP)
+		cbs.onHUP();
+	if (gQuit) return false;
+	if (revents & EPOLLIN)
+		cbs.onRead();
+	if (gQuit) return false;
+	if ((revents & EPOLLOUT) && cbs.onWrite)
+		cbs.onWrite();
+	return !gQuit;
+}
+
+#ifdef HAS_IO_URING
+static void
+uringDispatch(const struct io_uring_cqe& cqe)
+{
+	uint64_t op = cqe.user_data & kOpMask;
+	if (op == kOpCancel)
+		return;
+
+	FDEntry *entry = uringEntry(cqe.user_data);
+	--entry->inflight;
+	// removed by a previous callback
+	if (entry->removing)
+		return;
+
+	switch (op) {
+	 case kOpWrite:
+		entry->onWriteDone(cqe.res);
+		return;
+	 case kOpWritable:
+		entry->cbs.onWrite();
+		return;
+	 case kOpRead:
+		entry->direct.onDone(cqe.res);
+		break;
+	 default:
+		if (cqe.res < 0) {
+			::fprintf(stderr, "poll failed: %s\n",
+			          ::strerror(-cqe.res));
+			entry->cbs.onError();
+		} else if (!dispatchEvents(entry, uint32_t(cqe.res))) {
+			return;
+		}
+		break;
+	}
+
+	if (!entry->removing && !gQuit)
+		uringArm(entry);
+}
+
+// Wait for at least one more completion. Only write completions and those
+// of fds being removed are handled right away, everything else is left for
+// the main loop so we don't recurse into arbitrary callbacks.
+static void
+uringWaitOne()
+{
+	gURing->enter(1);
+	struct io_uring_cqe cqe;
+	while (gURing->next(&cqe)) {
+		uint64_t op = cqe.user_data & kOpMask;
+		if (op == kOpWrite || op == kOpWritable || op == kOpCancel ||
+		    uringEntry(cqe.user_data)->removing)
+		{
+			uringDispatch(cqe);
+		} else {
+			gDeferredCQEs.push_back(cqe);
+		}
 	}
 }
 
+// The kernel must be done with an entry before we can free it. Outputs are
+// non-blocking, so nothing here waits for a write which cannot make progress:
+// the only operations left are polls and device reads, which get cancelled
+// right away.
+static void
+uringCancel(const vector<int>& fds)
+{
+	vector<FDEntry*> entries;
+	for (int fd : fds) {
+		auto iter = gFDEntries.find(fd);
+		if (iter == gFDEntries.end())
+			continue;
+		FDEntry *entry = iter->second.get();
+		entries.push_back(entry);
+
+		// already completed, but not dispatched yet
+		for (auto i = gDeferredCQEs.begin(); i != gDeferredCQEs.end();) {
+			if (uringEntry(i->user_data) == entry) {
+				--entry->inflight;
+				i = gDeferredCQEs.erase(i);
+			} else {
+				++i;
+			}
+		}
+
+		if (entry->inflight) {
+			gURing->cancel(uringData(entry, kOpPoll), kOpCancel);
+			gURing->cancel(uringData(entry, kOpRead), kOpCancel);
+			gURing->cancel(uringData(entry, kOpWrite), kOpCancel);
+			gURing->cancel(uringData(entry, kOpWritable),
+			               kOpCancel);
+		}
+	}
+
+	for (FDEntry *entry : entries) {
+		while (entry->inflight)
+			uringWaitOne();
+	}
+}
+
+static void
+uringLoopIteration()
+{
+	// Anything which came in during a wait has precedence, and we don't
+	// want to sleep while there's work to do.
+	gURing->enter(gDeferredCQEs.empty() ? 1 : 0);
+
+	auto deferred = std::move(gDeferredCQEs);
+	gDeferredCQEs.clear();
+	for (const auto& cqe : deferred) {
+		uringDispatch(cqe);
+		if (gQuit)
+			return;
+	}
+
+	struct io_uring_cqe cqe;
+	while (!gQuit && gURing->next(&cqe))
+		uringDispatch(cqe);
+}
+#endif
+
 static void
 removeOutput(int fd) {
 	removeFD(fd);
@@ -157,22 +1060,379 @@ static void
 removeOutput(const string& name)
 {
 	auto iter = gOutputs.find(name);
-	if (iter == gOutputs.end())
+	if (iter == gOutputs.end()) {
+#ifdef HAS_TLS
+		auto pending = gPendingOutputs.find(name);
+		if (pending != gPendingOutputs.end()) {
+			removeFD(pending->second.handshake_.fd());
+			return;
+		}
+#endif
 		throw MsgException("no such output: %s", name.c_str());
+	}
 	removeOutput(iter->second.fd());
 }
 
 static bool
-writeToOutput(int fd, const void *data, size_t size)
+outputFailed(Output& out)
+{
+	if (!out.failed_) {
+		::fprintf(stderr, "error writing to output %s, dropping: %s\n",
+		          out.name_.c_str(), ::strerror(errno));
+		out.failed_ = true;
+		removeOutput(out.fd());
+	}
+	return false;
+}
+
+static bool
+dropOutput(Output& out, const char *reason)
+{
+	::fprintf(stderr, "output %s %s, dropping\n", out.name_.c_str(),
+	          reason);
+	out.failed_ = true;
+	removeOutput(out.fd());
+	return false;
+}
+
+// Whether the output went without progress for longer than allowed.
+static bool
+outputExpired(const Output& out, uint64_t now)
+{
+	uint64_t limit = gOutputTimeout.timeout * 1000000ULL;
+	return limit &&
+	       ((out.stalledSince_ && now - out.stalledSince_ > limit) ||
+	        (out.awaitingSince_ && now - out.awaitingSince_ > limit));
+}
+
+// Some of the queued data went out.
+static void
+outputProgress(Output& out)
+{
+	out.stalledSince_ = out.queue_.empty() ? 0 : nowNS(CLOCK_MONOTONIC);
+	if (out.queue_.empty() && out.stateLost_) {
+		out.stateLost_ = false;
+		sendDeviceStates(out);
+	}
+}
+
+static void
+updateOutputPoll(Output& out)
+{
+#ifdef HAS_IO_URING
+	// Outputs are written via the ring, which only waits for them to
+	// become writable after a write failed with EAGAIN.
+	if (gURing) {
+		out.pollout_ = false;
+		return;
+	}
+#endif
+	bool want = !out.queue_.empty();
+	if (want == out.pollout_)
+		return;
+	out.pollout_ = want;
+	modifyFD(out.fd(), (want ? EPOLLOUT : 0) |
+	                   (out.listening_ ? EPOLLIN : 0));
+}
+
+// Push out as much queued data as the output currently accepts.
+static bool
+flushOutput(Output& out)
 {
-	if (::write(fd, data, size) != static_cast<ssize_t>(size)) {
-		::fprintf(stderr, "error writing to output, dropping\n");
-		removeOutput(fd);
+	if (out.failed_)
 		return false;
+	bool progress = false;
+	while (!out.queue_.empty()) {
+		auto& chunk = out.queue_.front();
+		auto got = ::write(out.fd(), chunk.data_.data() + chunk.sent_,
+		                   chunk.data_.size() - chunk.sent_);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return outputFailed(out);
+		}
+		progress = true;
+		chunk.sent_ += size_t(got);
+		out.queued_ -= size_t(got);
+		if (chunk.sent_ == chunk.data_.size())
+			out.queue_.pop_front();
 	}
+	if (progress)
+		outputProgress(out);
+	updateOutputPoll(out);
 	return true;
 }
 
+#ifdef HAS_IO_URING
+// Hand the front of the queue to the kernel unless it's still busy with a
+// previous part.
+static void
+uringSubmitOutput(Output& out)
+{
+	if (out.failed_ || out.writing_ || out.pollout_ || out.queue_.empty())
+		return;
+
+	size_t count = 0;
+	for (auto& chunk : out.queue_) {
+		if (count == sizeof(out.iov_)/sizeof(out.iov_[0]))
+			break;
+		out.iov_[count].iov_base = chunk.data_.data() + chunk.sent_;
+		out.iov_[count].iov_len = chunk.data_.size() - chunk.sent_;
+		++count;
+	}
+	gURing->writev(out.fd(), out.iov_, unsigned(count),
+	               uringData(out.entry_, kOpWrite));
+	++out.entry_->inflight;
+	out.writing_ = count;
+}
+
+static void
+uringSubmitOutputs()
+{
+	for (auto& oi : gOutputs)
+		uringSubmitOutput(oi.second);
+}
+
+static void
+uringOutputWritten(Output& out, ssize_t result)
+{
+	out.writing_ = 0;
+	if (result == -EAGAIN) {
+		// flushOutput() takes over once it is writable again
+		gURing->pollAdd(out.fd(), POLLOUT,
+		                uringData(out.entry_, kOpWritable));
+		++out.entry_->inflight;
+		out.pollout_ = true;
+		return;
+	}
+	if (result < 0) {
+		errno = int(-result);
+		(void)outputFailed(out);
+		return;
+	}
+
+	auto got = size_t(result);
+	out.queued_ -= got;
+	while (got) {
+		auto& chunk = out.queue_.front();
+		size_t left = chunk.data_.size() - chunk.sent_;
+		if (got < left) {
+			chunk.sent_ += got;
+			break;
+		}
+		got -= left;
+		out.queue_.pop_front();
+	}
+	outputProgress(out);
+}
+#endif
+
+// Nanoseconds until a stalled output expires, 0 if it already has, -1 if
+// there is no timeout.
+static int64_t
+outputTimeLeft(const Output& out)
+{
+	if (!gOutputTimeout.timeout)
+		return -1;
+	uint64_t limit = gOutputTimeout.timeout * 1000000ULL;
+	uint64_t waited = nowNS(CLOCK_MONOTONIC) - out.stalledSince_;
+	return waited >= limit ? 0 : int64_t(limit - waited);
+}
+
+static bool
+flushOutputBlocking(Output& out)
+{
+#ifdef HAS_IO_URING
+	if (gURing) {
+		while (!out.failed_ && !out.queue_.empty()) {
+			int64_t left = outputTimeLeft(out);
+			if (!left)
+				return dropOutput(out, "timed out");
+			uringSubmitOutput(out);
+			// completions tagged kOpCancel are ignored
+			if (left > 0)
+				gURing->timeout(uint64_t(left),
+				                uringData(nullptr, kOpCancel));
+			uringWaitOne();
+		}
+		return !out.failed_;
+	}
+#endif
+	while (flushOutput(out)) {
+		if (out.queue_.empty())
+			return true;
+		int64_t left = outputTimeLeft(out);
+		if (!left)
+			return dropOutput(out, "timed out");
+		int wait = left < 0 ? -1 : int(left / 1000000) + 1;
+		struct pollfd pfd { out.fd(), POLLOUT, 0 };
+		if (::poll(&pfd, 1, wait) < 0 && errno != EINTR)
+			return outputFailed(out);
+	}
+	return false;
+}
+
+// Drop queued event frames which have not been started yet, oldest first,
+// until `size` more bytes fit into the queue. Since this may drop key
+// releases, the device state is sent once the queue drained.
+static void
+dropOldest(Output& out, size_t size)
+{
+	// chunks being written by the ring have to stay
+	auto i = out.queue_.begin() + ptrdiff_t(out.writing_);
+	while (i != out.queue_.end() && out.queued_ + size > out.queueLimit_)
+	{
+		if (!i->droppable_ || i->sent_) {
+			++i;
+			continue;
+		}
+		out.queued_ -= i->data_.size();
+		++out.dropped_;
+		out.stateLost_ = true;
+		i = out.queue_.erase(i);
+	}
+}
+
+// Datagrams are never queued, those the kernel does not take right away are
+// lost like any other, and the receiver asks for a resync.
+static bool
+writeDatagram(Output& out, const struct iovec *iov, size_t count)
+{
+	NE2DatagramHeader header;
+	::memcpy(header.magic, kNE2DatagramMagic, sizeof(header.magic));
+	header.version = htobe16(out.protocol_);
+	header.reserved = 0;
+	header.seq = htobe32(out.datagramSeq_++);
+
+	struct iovec parts[8] = { { &header, sizeof(header) } };
+	if (count >= sizeof(parts)/sizeof(parts[0]))
+		throw Exception("internal error: too many iovecs");
+	std::copy(iov, iov + count, parts + 1);
+	struct msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = parts;
+	msg.msg_iovlen = count + 1;
+	if (::sendmsg(out.fd(), &msg, MSG_DONTWAIT) >= 0)
+		return true;
+	switch (errno) {
+	 case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+	 case EWOULDBLOCK:
+#endif
+	 case ENOBUFS:
+		++out.dropped_;
+		return true;
+	 case ECONNREFUSED:
+		// nobody listening (yet), as reported by an earlier datagram
+		return true;
+	 default:
+		return outputFailed(out);
+	}
+}
+
+static bool
+writeToOutput(Output& out, const struct iovec *iov, size_t count,
+              bool droppable)
+{
+	if (out.failed_)
+		return false;
+	if (out.datagram_)
+		return writeDatagram(out, iov, count);
+
+	size_t size = 0;
+	for (size_t i = 0; i != count; ++i)
+		size += iov[i].iov_len;
+
+	size_t skip = 0;
+	if (out.queue_.empty() && !usingURing()) {
+		auto got = ::writev(out.fd(), iov, int(count));
+		if (got == static_cast<ssize_t>(size))
+			return true;
+		if (got < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return outputFailed(out);
+			got = 0;
+		}
+		// The rest of a partially written packet must not be dropped.
+		if (got)
+			droppable = false;
+		skip = size_t(got);
+		size -= skip;
+	}
+
+	if (out.queued_ + size > out.queueLimit_) {
+		switch (out.overflow_) {
+		 case OverflowPolicy::Block:
+			if (!flushOutputBlocking(out))
+				return false;
+			break;
+		 case OverflowPolicy::DropOldest:
+			dropOldest(out, size);
+			if (droppable && out.queued_ + size > out.queueLimit_) {
+				++out.dropped_;
+				out.stateLost_ = true;
+				return true;
+			}
+			break;
+		 case OverflowPolicy::DropOutput:
+			return dropOutput(out, "is not keeping up");
+		}
+	}
+
+	vector<uint8_t> rest;
+	rest.reserve(size);
+	for (size_t i = 0; i != count; ++i) {
+		auto bytes = reinterpret_cast<const uint8_t*>(iov[i].iov_base);
+		size_t len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		rest.insert(rest.end(), bytes + skip, bytes + len);
+		skip = 0;
+	}
+	if (out.queue_.empty())
+		out.stalledSince_ = nowNS(CLOCK_MONOTONIC);
+	out.queue_.emplace_back(OutputChunk { std::move(rest), 0, droppable });
+	out.queued_ += size;
+	// With io_uring everything queued up goes out in one go right before
+	// waiting for completions.
+	if (usingURing())
+		return true;
+	// If we blocked above this should go through right away.
+	return flushOutput(out);
+}
+
+static bool
+writeToOutput(Output& out, const void *data, size_t size, bool droppable)
+{
+	struct iovec iov { const_cast<void*>(data), size };
+	return writeToOutput(out, &iov, 1, droppable);
+}
+
+// Anything but events, in the format of the output's protocol version.
+static bool
+writePacket(Output& out, const struct iovec *iov, size_t count)
+{
+	if (out.protocol_ < kNE3Version)
+		return writeToOutput(out, iov, count, false);
+	static uint8_t tag = kNE3Packet;
+	struct iovec tagged[3] = { { &tag, 1 } };
+	if (count >= sizeof(tagged)/sizeof(tagged[0]))
+		throw Exception("internal error: too many iovecs");
+	std::copy(iov, iov + count, tagged + 1);
+	return writeToOutput(out, tagged, count + 1, false);
+}
+
+static bool
+writePacket(Output& out, const NE2Packet& pkt)
+{
+	struct iovec iov { const_cast<NE2Packet*>(&pkt), sizeof(pkt) };
+	return writePacket(out, &iov, 1);
+}
+
 static void
 announceDeviceRemoval(Input& input)
 {
@@ -182,7 +1442,7 @@ announceDeviceRemoval(Input& input)
 	pkt.remove_device.id = htobe16(input.id_);
 
 	for (auto& oi: gOutputs)
-		(void)writeToOutput(oi.second.fd(), &pkt, sizeof(pkt));
+		(void)writePacket(oi.second, pkt);
 }
 
 static void
@@ -199,15 +1459,22 @@ cleanupDeviceHotkeys(uint16_t id)
 static void
 processRemoveQueue()
 {
-	for (int fd : gFDRemoveQueue) {
-		auto cbs = gFDCBs.find(fd);
-		if (cbs == gFDCBs.end())
-			throw Exception("FD without cleanup callback");
-		cbs->second.onRemove();
-		gFDCBs.erase(cbs);
+	// Waiting for cancellations may remove more fds.
+	while (!gFDRemoveQueue.empty()) {
+		auto queue = std::move(gFDRemoveQueue);
+		gFDRemoveQueue.clear();
+#ifdef HAS_IO_URING
+		if (gURing)
+			uringCancel(queue);
+#endif
+		for (int fd : queue) {
+			auto entry = gFDEntries.find(fd);
+			if (entry == gFDEntries.end())
+				throw Exception("FD without cleanup callback");
+			entry->second->cbs.onRemove();
+			gFDEntries.erase(entry);
+		}
 	}
-
-	gFDRemoveQueue.clear();
 }
 
 static void
@@ -258,12 +1525,6 @@ readCommand(FILE *file)
 	queueCommand(fd, line);
 }
 
-static void
-addFD(int fd, short events = POLLIN | POLLHUP | POLLERR)
-{
-	gFDAddQueue.emplace_back(pollfd { fd, events, 0 });
-}
-
 static void
 newCommandClient(Socket& server)
 {
@@ -276,13 +1537,13 @@ newCommandClient(Socket& server)
 	FILEHandle bufhandle { buffd };
 	(void)h.release();
 
-	addFD(fd);
-	gFDCBs[fd] = FDCallbacks {
+	addFD(fd, FDCallbacks {
 		[buffd]() { readCommand(buffd); },
+		nullptr,
 		[fd]() { disconnectClient(fd); },
 		[fd]() { disconnectClient(fd); },
 		[fd]() { finishClientRemoval(fd); },
-	};
+	});
 	gCommandClients.emplace(fd, std::move(bufhandle));
 }
 
@@ -297,6 +1558,12 @@ toClient(int fd, const char *fmt, ...)
 	auto length = ::vsnprintf(buf, sizeof(buf), fmt, ap);
 	int err = errno;
 	va_end(ap);
+	// with --threads clients are not fds
+	if (gControl && fd >= 0) {
+		if (length > 0)
+			gControl->reply(fd, string(buf, size_t(length)));
+		return;
+	}
 	if (length <= 0) {
 		::fprintf(stderr, "faield to format client response: %s\n",
 		          ::strerror(err));
@@ -336,7 +1603,10 @@ freeInputID(uint16_t id)
 static void
 closeDevice(InDevice *device)
 {
-	removeFD(device->fd());
+	for (auto& ii : gInputs) {
+		if (ii.second.device_.get() == device)
+			return removeFD(ii.second.fd());
+	}
 }
 
 static void
@@ -378,9 +1648,19 @@ static void
 useOutput(int clientfd, const string& name)
 {
 	auto iter = gOutputs.find(name);
+#ifdef HAS_TLS
+	auto pending = gPendingOutputs.find(name);
+	if (iter == gOutputs.end() && pending != gPendingOutputs.end()) {
+		pending->second.use_ = true;
+		toClient(clientfd, "output %s is still connecting\n",
+		         name.c_str());
+		return;
+	}
+#endif
 	if (iter == gOutputs.end())
 		throw MsgException("no such output: %s", name.c_str());
 	gCurrentOutput.fd = iter->second.fd();
+	gCurrentOutput.output = &iter->second;
 	gCurrentOutput.name = name;
 
 	setEnvVar("NETEVENT_OUTPUT_NAME", name.c_str());
@@ -421,7 +1701,10 @@ grab(int clientfd, bool on)
 static void
 lostCurrentOutput()
 {
+	for (auto& i: gInputs)
+		i.second.frame_.clear();
 	gCurrentOutput.fd = -1;
+	gCurrentOutput.output = nullptr;
 	gCurrentOutput.name = "<none>";
 	if (gWrite)
 		writeEvents(-1, false);
@@ -429,70 +1712,309 @@ lostCurrentOutput()
 		grab(-1, false);
 }
 
+// evdev timestamps use CLOCK_REALTIME unless told otherwise
+static void
+recordLatency(const InputEvent& ev)
+{
+	uint64_t stamp = ev.tv_sec * 1000000000ULL + ev.tv_usec * 1000ULL;
+	uint64_t now = nowNS(CLOCK_REALTIME);
+	if (stamp > now)
+		return;
+	auto& entry = gBusyPoll.latency[gBusyPoll.spinning ? 1 : 0];
+	++entry.count;
+	entry.total += now - stamp;
+}
+
+// Where the input's events go, apart from the mirror outputs.
+static Output*
+inputTarget(const Input& input)
+{
+	if (input.route_.empty())
+		return gCurrentOutput.output;
+	return input.routeOutput_;
+}
+
+// The ways events can be sent, depending on an output's protocol version and
+// features.
+enum class EventEncoding { NE2Events, NE2Frames, NE3Frames, Count };
+
+static EventEncoding
+eventEncoding(const Output& out)
+{
+	if (out.protocol_ >= kNE3Version)
+		return EventEncoding::NE3Frames;
+	if (out.features_ & kNE2FeatureFrames)
+		return EventEncoding::NE2Frames;
+	return EventEncoding::NE2Events;
+}
+
+// DeviceFrame packets share one timestamp, so a new one is started whenever
+// it changes.
+static void
+encodeNE2Frames(vector<uint8_t>& out, uint16_t id,
+                Span<const InputEvent> events)
+{
+	auto ev = events.begin();
+	while (ev != events.end()) {
+		auto end = ev + 1;
+		while (end != events.end() && end - ev < 0xFFFF &&
+		       end->tv_sec == ev->tv_sec && end->tv_usec == ev->tv_usec)
+			++end;
+
+		NE2Packet pkt = {};
+		::memset(reinterpret_cast<void*>(&pkt), 0, sizeof(pkt));
+		pkt.cmd = htobe16(uint16_t(NE2Command::DeviceFrame));
+		pkt.frame.id = htobe16(id);
+		pkt.frame.count = htobe16(uint16_t(end - ev));
+		pkt.frame.tv_sec = htobe64(ev->tv_sec);
+		pkt.frame.tv_usec = htobe32(ev->tv_usec);
+		size_t at = out.size();
+		out.resize(at + sizeof(pkt) +
+		           size_t(end - ev) * sizeof(NE2FrameEvent));
+		::memcpy(&out[at], &pkt, sizeof(pkt));
+		at += sizeof(pkt);
+		for (; ev != end; ++ev) {
+			NE2FrameEvent fev;
+			fev.type = htobe16(ev->type);
+			fev.code = htobe16(ev->code);
+			fev.value = static_cast<int32_t>(
+			    htobe32(uint32_t(ev->value)));
+			::memcpy(&out[at], &fev, sizeof(fev));
+			at += sizeof(fev);
+		}
+	}
+}
+
+static void
+encodeFrame(vector<uint8_t>& out, EventEncoding encoding, uint16_t id,
+            Span<const InputEvent> events)
+{
+	out.clear();
+	if (encoding == EventEncoding::NE3Frames)
+		return encodeNE3Frame(out, id, events);
+	if (encoding == EventEncoding::NE2Frames)
+		return encodeNE2Frames(out, id, events);
+
+	NE2Packet pkt = {};
+	pkt.cmd = htobe16(uint16_t(NE2Command::DeviceEvent));
+	pkt.event.id = htobe16(id);
+	out.resize(events.size() * sizeof(pkt));
+	auto dst = out.data();
+	for (const auto& ev : events) {
+		pkt.event.event = ev;
+		pkt.event.event.toNet();
+		::memcpy(dst, &pkt, sizeof(pkt));
+		dst += sizeof(pkt);
+	}
+}
+
+static void
+flushFrame(Input& input)
+{
+	auto& frame = input.frame_;
+	if (frame.empty())
+		return;
+
+	// The frame is encoded once per encoding and the same buffer goes to
+	// every output using it, on error the output gets dropped.
+	static const size_t kCount = size_t(EventEncoding::Count);
+	static vector<uint8_t> encoded[kCount];
+	bool done[kCount] = {};
+	Span<const InputEvent> events { frame.data(), frame.size() };
+	auto send = [&](Output& out) {
+		EventEncoding encoding = eventEncoding(out);
+		size_t i = size_t(encoding);
+		if (!done[i]) {
+			encodeFrame(encoded[i], encoding, input.id_, events);
+			done[i] = true;
+		}
+		(void)writeToOutput(out, encoded[i].data(), encoded[i].size(),
+		                    true);
+	};
+	Output *target = inputTarget(input);
+	if (target)
+		send(*target);
+	for (Output *mirror : gMirrorOutputs) {
+		if (mirror != target)
+			send(*mirror);
+	}
+	frame.clear();
+}
+
+// The snapshot is split into frames small enough for a datagram each. Used
+// for UDP resyncs and after drop-oldest dropped frames.
+static void
+sendDeviceStates(Output& out)
+{
+	if (!gWrite)
+		return;
+	bool mirror = std::find(gMirrorOutputs.begin(), gMirrorOutputs.end(),
+	                        &out) != gMirrorOutputs.end();
+	static const size_t kChunk = 128;
+	vector<InputEvent> state;
+	vector<uint8_t> encoded;
+	for (auto& ii : gInputs) {
+		Input& input = ii.second;
+		if (!mirror && inputTarget(input) != &out)
+			continue;
+		try {
+			input.device_->currentState(state);
+		} catch (const Exception& ex) {
+			::fprintf(stderr, "%s\n", ex.what());
+			continue;
+		}
+		for (size_t at = 0; at < state.size(); at += kChunk) {
+			size_t end = std::min(at + kChunk, state.size());
+			vector<InputEvent> frame(state.begin() + ptrdiff_t(at),
+			                         state.begin() + ptrdiff_t(end));
+			InputEvent syn = frame.back();
+			syn.type = EV_SYN;
+			syn.code = SYN_REPORT;
+			syn.value = 0;
+			frame.push_back(syn);
+			encodeFrame(encoded, eventEncoding(out), input.id_,
+			            { frame.data(), frame.size() });
+			if (!writeToOutput(out, encoded.data(), encoded.size(),
+			                   true))
+				return;
+		}
+	}
+}
+
+static void
+forwardEvents(Input *input, Span<const InputEvent> events)
+{
+	uint16_t id = input->id_;
+
+	if (!events.empty())
+		recordLatency(events[0]);
+
+	for (const auto& ev : events) {
+		if (tryHotkey(id, ev.type, ev.code, ev.value)) {
+			// Run the hotkey right away so the rest of the batch
+			// already sees its effect (eg. a changed output).
+			flushFrame(*input);
+			processCommandQueue();
+			if (isRemoving(input->fd()))
+				return;
+			continue;
+		}
+
+		if (!inputTarget(*input) && gMirrorOutputs.empty())
+			continue;
+
+		if (!gWrite)
+			continue;
+
+		input->frame_.push_back(ev);
+
+		// Send whole frames with a single write.
+		if (!gFrameBatching ||
+		    (ev.type == EV_SYN && ev.code == SYN_REPORT))
+		{
+			flushFrame(*input);
+		}
+	}
+}
+
+static void
+readFromDevice(Input *input)
+{
+	InDevice *device = input->device_.get();
+	Span<const InputEvent> events;
+	try {
+		events = device->readBatch();
+	} catch (const Exception& ex) {
+		::fprintf(stderr, "error reading device: %s\n", ex.what());
+		return closeDevice(device);
+	}
+	forwardEvents(input, events);
+}
+
+// The device's reader thread queued up more events.
+static void
+readFromThread(Input *input)
+{
+	DeviceReader *reader = input->reader_.get();
+	eventfd_t value;
+	(void)::eventfd_read(reader->fd(), &value);
+	while (true) {
+		// check first, the last events are queued before the failure
+		bool failed = reader->failed();
+		auto events = reader->queue().peek();
+		if (events.empty()) {
+			if (failed) {
+				::fprintf(stderr, "error reading device: %s\n",
+				          reader->error().c_str());
+				closeDevice(input->device_.get());
+			}
+			return;
+		}
+		forwardEvents(input, events);
+		reader->consumed(events.size());
+		if (isRemoving(input->fd()))
+			return;
+	}
+}
+
+#ifdef HAS_IO_URING
+// The ring read directly into the device's buffer.
 static void
-readFromDevice(InDevice *device, uint16_t id)
+deviceReadDone(Input *input, ssize_t result)
 {
-	NE2Packet pkt = {};
+	InDevice *device = input->device_.get();
+	Span<const InputEvent> events;
 	try {
-		if (!device->read(&pkt.event.event)) {
-			fireEvent(-1, DEVICE_LOST_EVENT);
-			return closeDevice(device);
+		if (result < 0) {
+			errno = int(-result);
+			throw ErrnoException("failed to read from device");
 		}
+		if (result == 0)
+			throw Exception("unexpected EOF");
+		events = device->convertBatch(size_t(result));
 	} catch (const Exception& ex) {
 		::fprintf(stderr, "error reading device: %s\n", ex.what());
 		return closeDevice(device);
 	}
-
-	const auto& ev = pkt.event.event;
-	if (tryHotkey(id, ev.type, ev.code, ev.value))
-		return;
-
-	if (gCurrentOutput.fd == -1)
-		return;
-
-	if (!gWrite)
-		return;
-
-	pkt.cmd = htobe16(uint16_t(NE2Command::DeviceEvent));
-	pkt.event.id = htobe16(id);
-	pkt.event.event.toNet();
-	if (mustWrite(gCurrentOutput.fd, &pkt, sizeof(pkt)))
-		return;
-
-	// on error we drop the output:
-	::fprintf(stderr, "error writing to output %s: %s\n",
-	          gCurrentOutput.name.c_str(), ::strerror(errno));
-	removeOutput(gCurrentOutput.fd);
-	lostCurrentOutput();
+	forwardEvents(input, events);
 }
+#endif
 
 static bool
-announceDevice(Input& input, int fd)
+announceDevice(Input& input, Output& out)
 {
+	const vector<uint8_t> *desc;
 	try {
-		input.device_->writeNE2AddDevice(fd, input.id_);
-		return true;
+		desc = &input.device_->ne2Descriptor();
 	} catch (const Exception& ex) {
 		::fprintf(stderr,
 			  "error creating device on output, dropping: %s\n",
 			  ex.what());
-		removeOutput(fd);
+		out.failed_ = true;
+		removeOutput(out.fd());
 		return false;
 	}
+	// header and the cached descriptor with a single write
+	NE2Packet pkt = input.device_->ne2AddDeviceHeader(input.id_);
+	struct iovec iov[2] = {
+		{ &pkt, sizeof(pkt) },
+		{ const_cast<uint8_t*>(desc->data()), desc->size() },
+	};
+	return writePacket(out, iov, 2);
 }
 
 static void
 announceDevice(Input& input)
 {
 	for (auto& oi: gOutputs)
-		announceDevice(input, oi.second.fd());
+		announceDevice(input, oi.second);
 }
 
 static void
-announceAllDevices(int fd)
+announceAllDevices(Output& out)
 {
 	for (auto& i: gInputs) {
-		if (!announceDevice(i.second, fd))
+		if (!announceDevice(i.second, out))
 			break;
 	}
 }
@@ -504,16 +2026,40 @@ addDevice(const string& name, const char *path)
 		throw MsgException("output already exists: %s", name.c_str());
 
 	auto id = getNextInputID();
+	Input *weakinput = nullptr;
 	try {
-		Input input { id, uniq<InDevice> { new InDevice { path } } };
+		Input input {
+			id, uniq<InDevice> { new InDevice { path } }, {}, {},
+			nullptr, {}
+		};
 		InDevice *weakdevptr = input.device_.get();
-		int fd = weakdevptr->fd();
 
 		announceDevice(input);
 
-		addFD(fd);
-		gFDCBs[fd] = FDCallbacks {
-			[=]() { readFromDevice(weakdevptr, id); },
+		// std::map nodes don't move, so we can keep a pointer:
+		weakinput =
+		    &gInputs.emplace(name, std::move(input)).first->second;
+
+		DirectRead direct {
+			weakdevptr->rawBuffer(),
+#ifdef HAS_IO_URING
+			[=](ssize_t result) {
+				deviceReadDone(weakinput, result);
+			},
+#else
+			nullptr,
+#endif
+		};
+		function<void()> onRead = [=]() { readFromDevice(weakinput); };
+		if (gThreaded) {
+			weakinput->reader_.reset(new DeviceReader { *weakdevptr });
+			onRead = [=]() { readFromThread(weakinput); };
+			direct = DirectRead {};
+		}
+
+		addFD(weakinput->fd(), FDCallbacks {
+			std::move(onRead),
+			nullptr,
 			[=]() {
 				fireEvent(-1, DEVICE_LOST_EVENT);
 				closeDevice(weakdevptr);
@@ -523,9 +2069,10 @@ addDevice(const string& name, const char *path)
 				closeDevice(weakdevptr);
 			},
 			[=]() { finishDeviceRemoval(weakdevptr); },
-		};
-		gInputs.emplace(name, std::move(input));
+		}, EPOLLIN, std::move(direct));
 	} catch (const std::exception&) {
+		if (weakinput)
+			gInputs.erase(name);
 		freeInputID(id);
 		throw;
 	}
@@ -546,6 +2093,17 @@ removeDevice(const string& name)
 	closeDevice(findDevice(name));
 }
 
+static void
+mirrorOutput(Output& out, bool on)
+{
+	auto iter = std::find(gMirrorOutputs.begin(), gMirrorOutputs.end(),
+	                      &out);
+	if (on && iter == gMirrorOutputs.end())
+		gMirrorOutputs.push_back(&out);
+	else if (!on && iter != gMirrorOutputs.end())
+		gMirrorOutputs.erase(iter);
+}
+
 static void
 finishOutputRemoval(int fd)
 {
@@ -553,6 +2111,14 @@ finishOutputRemoval(int fd)
 		lostCurrentOutput();
 	for (auto i = gOutputs.begin(); i != gOutputs.end(); ++i) {
 		if (i->second.fd() == fd) {
+			mirrorOutput(i->second, false);
+			for (auto& ii : gInputs) {
+				Input& input = ii.second;
+				if (input.routeOutput_ == &i->second) {
+					input.routeOutput_ = nullptr;
+					input.frame_.clear();
+				}
+			}
 			gOutputs.erase(i);
 			return;
 		}
@@ -560,60 +2126,377 @@ finishOutputRemoval(int fd)
 	throw MsgException("finishOutputRemove: faile dot find fd");
 }
 
-// TODO:
-//   - tcp:IP PORT
-//   - tcp:HOSTNAME PORT
-//   - tcp:[IP] PORT
-//   - tcp:[HOSTNAME] PORT
-//           Unsafe but still useful.
-//   - tcp:DESTINATION PORT CERT KEY CACERTorPATH
-//   - tcp:[DESTINATION] PORT CERT KEY CACERTorPATH
-//           Annoying & require an ssl lib but more useful than the non-ssl
-//           variant...
+// Switch the stream to another protocol version or set of features, the
+// Hello packet telling the receiver is still sent in the old format.
+static bool
+switchProtocol(Output& out, uint16_t version, uint16_t features = 0)
+{
+	NE2Packet hello = makeHello(version, version, features);
+	if (!writePacket(out, hello))
+		return false;
+	out.protocol_ = version;
+	out.features_ = features;
+	return true;
+}
+
+// Receivers which can talk back are asked to echo the packet.
+static void
+sendKeepAlive(Output& out)
+{
+	NE2Packet pkt = {};
+	::memset(reinterpret_cast<void*>(&pkt), 0, sizeof(pkt));
+	pkt.cmd = htobe16(uint16_t(NE2Command::KeepAlive));
+	uint16_t flags = out.listening_ ? kKeepAliveEcho : 0;
+	if (out.clockSampleCount_) {
+		flags |= kKeepAliveOffset;
+		pkt.keepalive.clock = htobe64(uint64_t(out.clockOffset_));
+	}
+	uint64_t now = nowNS(CLOCK_MONOTONIC);
+	pkt.keepalive.flags = htobe16(flags);
+	pkt.keepalive.seq = htobe32(++out.keepAliveSent_);
+	pkt.keepalive.time = htobe64(now);
+	// Only receivers which answered before are expected to.
+	if (out.rtt_.count && !out.awaitingSince_)
+		out.awaitingSince_ = now;
+	(void)writePacket(out, pkt);
+}
+
+static void
+keepAliveTimer()
+{
+	uint64_t expirations;
+	if (::read(gKeepAlive.timer.fd(), &expirations,
+	           sizeof(expirations)) < 0)
+		return;
+	for (auto& oi: gOutputs) {
+		sendKeepAlive(oi.second);
+		// Repairs losses even if the receiver's requests got lost.
+		if (oi.second.datagram_)
+			sendDeviceStates(oi.second);
+	}
+}
+
+static void
+setKeepAlive(unsigned long interval)
+{
+	if (gKeepAlive.timer.fd() < 0) {
+		int fd = ::timerfd_create(CLOCK_MONOTONIC,
+		                          TFD_CLOEXEC | TFD_NONBLOCK);
+		if (fd < 0)
+			throw ErrnoException("failed to create keepalive timer");
+		gKeepAlive.timer = IOHandle { fd };
+		addFD(fd, FDCallbacks {
+			[]() { keepAliveTimer(); },
+			nullptr,
+			[]() {},
+			[]() {},
+			[]() {},
+		});
+	}
+	struct itimerspec spec;
+	::memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = time_t(interval);
+	spec.it_interval.tv_sec = time_t(interval);
+	if (::timerfd_settime(gKeepAlive.timer.fd(), 0, &spec, nullptr) != 0)
+		throw ErrnoException("failed to set keepalive timer");
+	gKeepAlive.interval = interval;
+}
+
+// Drop outputs which stopped making progress, and probe the receivers
+// answering keepalives (after a first try to find out whether they do) so
+// a hung one is noticed even while idle.
+static void
+outputTimeoutTimer()
+{
+	uint64_t expirations;
+	if (::read(gOutputTimeout.timer.fd(), &expirations,
+	           sizeof(expirations)) < 0)
+		return;
+	uint64_t now = nowNS(CLOCK_MONOTONIC);
+	for (auto& oi: gOutputs) {
+		Output& out = oi.second;
+		if (out.failed_)
+			continue;
+		if (outputExpired(out, now))
+			(void)dropOutput(out, "timed out");
+		else if (out.listening_ && !out.awaitingSince_ &&
+		         (out.rtt_.count || !out.keepAliveSent_))
+			sendKeepAlive(out);
+	}
+}
+
+// The outputs are checked four times per timeout.
+static void
+setOutputTimeout(unsigned long timeout)
+{
+	if (gOutputTimeout.timer.fd() < 0) {
+		int fd = ::timerfd_create(CLOCK_MONOTONIC,
+		                          TFD_CLOEXEC | TFD_NONBLOCK);
+		if (fd < 0)
+			throw ErrnoException("failed to create output timer");
+		gOutputTimeout.timer = IOHandle { fd };
+		addFD(fd, FDCallbacks {
+			[]() { outputTimeoutTimer(); },
+			nullptr,
+			[]() {},
+			[]() {},
+			[]() {},
+		});
+	}
+	uint64_t period = timeout * 1000000ULL / 4;
+	struct itimerspec spec;
+	::memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = time_t(period / 1000000000ULL);
+	spec.it_value.tv_nsec = long(period % 1000000000ULL);
+	spec.it_interval = spec.it_value;
+	if (::timerfd_settime(gOutputTimeout.timer.fd(), 0, &spec, nullptr))
+		throw ErrnoException("failed to set output timer");
+	gOutputTimeout.timeout = timeout;
+	// Nothing counts as waiting from before.
+	for (auto& oi: gOutputs)
+		oi.second.awaitingSince_ = 0;
+}
+
+static void
+keepAliveReply(Output& out, const NE2Packet& pkt)
+{
+	uint64_t sent = be64toh(pkt.keepalive.time);
+	uint64_t now = nowNS(CLOCK_MONOTONIC);
+	if (sent > now)
+		return;
+	uint64_t rtt = now - sent;
+	auto& stats = out.rtt_;
+	stats.last = rtt;
+	if (!stats.count || rtt < stats.min)
+		stats.min = rtt;
+	if (rtt > stats.max)
+		stats.max = rtt;
+	stats.total += rtt;
+	++stats.count;
+	out.keepAliveAnswered_ = be32toh(pkt.keepalive.seq);
+	// Any later keepalive still waiting was sent before now.
+	out.awaitingSince_ = out.keepAliveAnswered_ == out.keepAliveSent_
+	                     ? 0 : now;
+
+	// Assuming both directions take equally long, the receiver read its
+	// clock half a round trip ago.
+	uint64_t theirs = be64toh(pkt.keepalive.clock);
+	if (!theirs)
+		return;
+	uint64_t ours = nowNS(CLOCK_REALTIME) - rtt / 2;
+	auto& sample =
+	    out.clockSamples_[out.clockSampleCount_++ % kClockSamples];
+	sample.rtt = rtt;
+	sample.offset = int64_t(ours - theirs);
+	size_t count = std::min(out.clockSampleCount_, kClockSamples);
+	auto best = std::min_element(out.clockSamples_,
+	                             out.clockSamples_ + count,
+	    [](const decltype(sample)& a, const decltype(sample)& b) {
+		return a.rtt < b.rtt;
+	    });
+	out.clockOffset_ = best->offset;
+}
+
+// Everything the receiver may have missed: the devices and their current
+// state, the latter only for devices whose events go to this output.
+static void
+resyncOutput(Output& out)
+{
+	// Requests keep coming until the first resync arrives.
+	uint64_t now = nowNS(CLOCK_MONOTONIC);
+	if (now - out.resyncedAt_ < 100000000ULL)
+		return;
+	out.resyncedAt_ = now;
+	// the receiver may also have missed our offer
+	if (out.negotiate_ && out.protocol_ == kNE2Version && !out.features_) {
+		NE2Packet hello = makeHello(kNE2Version, kNE3Version,
+		                            kNE2Features);
+		if (!writePacket(out, hello))
+			return;
+	}
+	announceAllDevices(out);
+	sendDeviceStates(out);
+}
+
+static void
+outputReply(Output& out, NE2Packet& pkt)
+{
+	if (be16toh(pkt.cmd) == uint16_t(NE2Command::Resync)) {
+		if (out.datagram_)
+			resyncOutput(out);
+		return;
+	}
+	if (be16toh(pkt.cmd) == uint16_t(NE2Command::KeepAlive)) {
+		if (be16toh(pkt.keepalive.flags) & kKeepAliveReply)
+			keepAliveReply(out, pkt);
+		return;
+	}
+	if (be16toh(pkt.cmd) != uint16_t(NE2Command::Hello) ||
+	    ::memcmp(pkt.hello.magic, kNE2Hello, sizeof(pkt.hello.magic)) != 0)
+		return;
+	uint16_t version = be16toh(pkt.hello.version);
+	uint16_t features = be16toh(pkt.hello.features) & kNE2Features;
+	if (version < kNE2Version || version > kNE3Version ||
+	    (version == out.protocol_ && features == out.features_))
+		return;
+	(void)switchProtocol(out, version, features);
+}
+
+// A UDP receiver which is not running (yet) is no reason to give up. TCP
+// outputs report failing to connect here.
+static void
+outputError(Output& out)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (::getsockopt(out.fd(), SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+		error = 0;
+	if (out.datagram_ && (error == ECONNREFUSED || error == 0))
+		return;
+	if (error) {
+		errno = error;
+		(void)outputFailed(out);
+		return;
+	}
+	removeFD(out.fd());
+}
+
+// Receivers connected via a socket can answer with packets of their own.
+static void
+readFromOutput(Output& out)
+{
+	uint8_t buf[256];
+	ssize_t got = ::read(out.fd(), buf, sizeof(buf));
+	if (got < 0) {
+		// UDP: an earlier datagram found nobody listening
+		if (out.datagram_ && errno == ECONNREFUSED)
+			return;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			(void)outputFailed(out);
+		return;
+	}
+	if (got > 0 && out.tcp_)
+		Socket::quickAck(out.fd());
+	// Datagrams hold whole packets.
+	if (out.datagram_)
+		out.received_.clear();
+	if (got == 0 && out.datagram_)
+		return;
+	if (got == 0) {
+		// The receiver does not talk to us.
+		out.listening_ = false;
+		modifyFD(out.fd(),
+		         out.pollout_ && !usingURing() ? EPOLLOUT : 0);
+		return;
+	}
+	out.received_.insert(out.received_.end(), buf, buf + got);
+	size_t at = 0;
+	NE2Packet pkt = {};
+	while (out.received_.size() - at >= sizeof(pkt)) {
+		::memcpy(reinterpret_cast<void*>(&pkt), &out.received_[at],
+		         sizeof(pkt));
+		at += sizeof(pkt);
+		outputReply(out, pkt);
+		if (out.failed_)
+			return;
+	}
+	out.received_.erase(out.received_.begin(),
+	                    out.received_.begin() + ptrdiff_t(at));
+}
+
 static void
-addOutput_Finish(const string& name, IOHandle handle, bool skip_announce)
+addOutput_Finish(const string& name, IOHandle handle, bool skip_announce,
+                 OverflowPolicy overflow, size_t queue_size,
+                 uint16_t protocol)
 {
 	int fd = handle.fd();
-	writeHello(fd);
-	if (!skip_announce)
-		announceAllDevices(fd);
-	gOutputs.emplace(name, std::move(handle));
-	gFDCBs.emplace(fd, FDCallbacks {
-		[fd]() {
-			::fprintf(stderr, "onRead on output");
-			removeFD(fd);
-		},
-		[fd]() { removeFD(fd); },
+
+	// Writes must never block the daemon, slow outputs get their data
+	// queued instead. This includes writes submitted to io_uring: the
+	// kernel may not be able to cancel a blocked one when the output gets
+	// removed, and we have to wait for it.
+	int flags = ::fcntl(fd, F_GETFL);
+	if (flags == -1)
+		throw ErrnoException("failed to get output flags");
+	if (::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		throw ErrnoException("failed to set output flags");
+
+	Output *out = &gOutputs.emplace(name, Output {
+		name, std::move(handle), overflow, queue_size, {}
+	}).first->second;
+	// Receivers on sockets can ask for a protocol version (unless it is
+	// fixed, then the Hello packet offers nothing else) and echo
+	// keepalives.
+	struct stat st;
+	out->listening_ = ::fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+	int type = 0;
+	socklen_t typelen = sizeof(type);
+	out->datagram_ = out->listening_ &&
+	                 ::getsockopt(fd, SOL_SOCKET, SO_TYPE,
+	                              &type, &typelen) == 0 &&
+	                 type == SOCK_DGRAM;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	out->tcp_ = out->listening_ && !out->datagram_ &&
+	            ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr),
+	                          &addrlen) == 0 &&
+	            (addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+	for (auto& ii : gInputs) {
+		if (ii.second.route_ == name)
+			ii.second.routeOutput_ = out;
+	}
+
+	// Only wait for errors and hangups until something gets queued:
+	out->entry_ = addFD(fd, FDCallbacks {
+		[out]() { readFromOutput(*out); },
+		[out]() { (void)flushOutput(*out); },
 		[fd]() { removeFD(fd); },
+		[out]() { outputError(*out); },
 		[fd]() { finishOutputRemoval(fd); },
-	});
+	}, out->listening_ ? EPOLLIN : 0);
+#ifdef HAS_IO_URING
+	out->entry_->onWriteDone = [out](ssize_t result) {
+		uringOutputWritten(*out, result);
+	};
+#endif
+
+	out->negotiate_ = !protocol;
+	NE2Packet hello = protocol ? makeHello(kNE2Version, protocol)
+	                           : makeHello(kNE2Version, kNE3Version,
+	                                       kNE2Features);
+	if (writeToOutput(*out, &hello, sizeof(hello), false) &&
+	    (protocol <= kNE2Version || switchProtocol(*out, protocol)) &&
+	    !skip_announce)
+	{
+		announceAllDevices(*out);
+	}
+	if (out->failed_)
+		throw MsgException("failed to initialize output %s",
+		                   name.c_str());
 }
 
 static IOHandle
 addOutput_Open(const char *path)
 {
 	// Use O_NDELAY to not hang on FIFOs. FIFOs should already be waiting
-	// for our connection, we remove O_NONBLOCK below again.
+	// for our connection. Outputs stay non-blocking.
 	int fd = ::open(path, O_WRONLY | O_NDELAY | O_CLOEXEC);
 	if (fd < 0)
 		throw ErrnoException("open(%s)", path);
-	IOHandle handle { fd };
-
-	int flags = ::fcntl(fd, F_GETFL);
-	if (flags == -1)
-		throw ErrnoException("failed to get output flags");
-	if (::fcntl(fd, F_SETFL, flags & ~(O_NONBLOCK)) != 0)
-		throw ErrnoException("failed to remove O_NONBLOCK");
-
-	return handle;
+	return { fd };
 }
 
+// The command's stdin is a socket, so it can answer our Hello packet.
 static IOHandle
-addOutput_Exec(const char *path)
+addOutput_Exec(const char *path, bool reply)
 {
 	int pfd[2];
-	if (::pipe2(pfd, O_CLOEXEC) != 0)
+	if (reply) {
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pfd))
+			throw ErrnoException("socketpair() failed");
+	} else if (::pipe2(pfd, O_CLOEXEC) != 0) {
 		throw ErrnoException("pipe() failed");
+	}
 	IOHandle pr { pfd[0] };
 	IOHandle pw { pfd[1] };
 
@@ -625,13 +2508,16 @@ addOutput_Exec(const char *path)
 		pw.close();
 		pr.cloexec(false); // We need this one in our subprocess!
 
-		if (pr.fd() != 0) {
-			if (::dup2(pr.fd(), 0) != 0) {
-				::perror("dup2");
-				::exit(-1);
-			}
-			pr.close();
+		// With --reply its stdout gets back to us as well, so receivers
+		// behind eg. ssh can answer with `netevent create --reply-fd=1`.
+		if (::dup2(pr.fd(), 0) != 0 ||
+		    (reply && ::dup2(pr.fd(), 1) != 1))
+		{
+			::perror("dup2");
+			::exit(-1);
 		}
+		if (pr.fd() > (reply ? 1 : 0))
+			pr.close();
 		daemon_preExec();
 		::execlp("/bin/sh", "/bin/sh", "-c", path, nullptr);
 		::perror("exec() failed");
@@ -653,31 +2539,192 @@ addOutput_Unix(const char *path)
 	return socket.intoIOHandle();
 }
 
+// Unencrypted, for trusted networks. Everything written until the
+// connection is established gets queued, so unreachable hosts do not hold up
+// the daemon.
+static IOHandle
+addOutput_TCP(const char *spec)
+{
+	Socket socket;
+	socket.startConnectTCP(spec);
+	return socket.intoIOHandle();
+}
+
+static IOHandle
+addOutput_UDP(const char *spec)
+{
+	Socket socket;
+	socket.connectUDP(spec);
+	return socket.intoIOHandle();
+}
+
+#ifdef HAS_TLS
+static void
+finishTLSOutput(const string& name)
+{
+	auto iter = gPendingOutputs.find(name);
+	if (iter == gPendingOutputs.end())
+		return;
+	PendingOutput& pending = iter->second;
+	// erased once the fd is gone
+	removeFD(pending.handshake_.fd());
+	try {
+		bool resumed = false;
+		IOHandle handle = pending.handshake_.finish(&resumed);
+		addOutput_Finish(name, std::move(handle), pending.skipAnnounce_,
+		                 pending.overflow_, pending.queueSize_,
+		                 pending.protocol_);
+		Output& out = gOutputs.at(name);
+		out.tls_ = true;
+		out.tlsResumed_ = resumed;
+	} catch (const std::exception& ex) {
+		::fprintf(stderr, "failed to add output %s: %s\n",
+		          name.c_str(), ex.what());
+		return;
+	}
+	if (pending.use_)
+		useOutput(-1, name);
+}
+
+// HOST:PORT CERT KEY CACERTorPATH
+// The handshake is done on the relay thread, see finishTLSOutput().
+static void
+addOutput_TLS(const string& name, const char *spec, PendingOutput params)
+{
+	vector<string> words;
+	for (const char *at = spec; *at; ) {
+		size_t len = ::strcspn(at, " ");
+		if (len)
+			words.emplace_back(at, len);
+		at += len + (at[len] ? 1 : 0);
+	}
+	if (words.size() != 4)
+		throw MsgException(
+		    "expected tls:HOST:PORT CERT KEY CACERTorPATH: '%s'", spec);
+
+	string key = words[1] + '\n' + words[2] + '\n' + words[3];
+	auto& context = gTLSContexts[key];
+	if (!context) {
+		context = std::make_shared<TLSContext>(false,
+		    words[1].c_str(), words[2].c_str(), words[3].c_str());
+	}
+
+	Socket socket;
+	socket.startConnectTCP(words[0]);
+	string host, port;
+	splitHostPort(words[0], host, port);
+	params.handshake_ = context->connect(socket.intoIOHandle(), host);
+
+	int fd = params.handshake_.fd();
+	gPendingOutputs.emplace(name, std::move(params));
+	try {
+		addFD(fd, FDCallbacks {
+			[name]() { finishTLSOutput(name); },
+			nullptr,
+			[fd]() { removeFD(fd); },
+			[fd]() { removeFD(fd); },
+			[name]() { gPendingOutputs.erase(name); },
+		});
+	} catch (...) {
+		gPendingOutputs.erase(name);
+		throw;
+	}
+}
+#endif
+
 static void
-addOutput(const string& name, const char *path, bool skip_announce)
+addOutput(const string& name, const char *path, bool skip_announce,
+          OverflowPolicy overflow, size_t queue_size, uint16_t protocol,
+          bool reply)
 {
 	if (gOutputs.find(name) != gOutputs.end())
 		throw MsgException("output already exists: %s", name.c_str());
+#ifdef HAS_TLS
+	if (gPendingOutputs.find(name) != gPendingOutputs.end())
+		throw MsgException("output already exists: %s", name.c_str());
+#endif
 
 	IOHandle handle;
 	if (::strncmp(path, "exec:", sizeof("exec:")-1) == 0)
-		handle = addOutput_Exec(path+(sizeof("exec:")-1));
+		handle = addOutput_Exec(path+(sizeof("exec:")-1), reply);
 	else if (::strncmp(path, "unix:", sizeof("unix:")-1) == 0)
 		handle = addOutput_Unix(path+(sizeof("unix:")-1));
-	else
+	else if (::strncmp(path, "tcp:", sizeof("tcp:")-1) == 0)
+		handle = addOutput_TCP(path+(sizeof("tcp:")-1));
+	else if (::strncmp(path, "udp:", sizeof("udp:")-1) == 0)
+		handle = addOutput_UDP(path+(sizeof("udp:")-1));
+	else if (::strncmp(path, "tls:", sizeof("tls:")-1) == 0) {
+#ifdef HAS_TLS
+		addOutput_TLS(name, path+(sizeof("tls:")-1), PendingOutput {
+			{}, skip_announce, overflow, queue_size, protocol, false
+		});
+		return;
+#else
+		throw Exception("netevent was built without tls support");
+#endif
+	} else
 		handle = addOutput_Open(path);
 
-	return addOutput_Finish(name, std::move(handle), skip_announce);
+	addOutput_Finish(name, std::move(handle), skip_announce,
+	                 overflow, queue_size, protocol);
+}
+
+static OverflowPolicy
+parseOverflowPolicy(const char *text)
+{
+	if (!::strcasecmp(text, "block"))
+		return OverflowPolicy::Block;
+	if (!::strcasecmp(text, "drop-oldest"))
+		return OverflowPolicy::DropOldest;
+	if (!::strcasecmp(text, "drop-output"))
+		return OverflowPolicy::DropOutput;
+	throw MsgException("unknown overflow policy: %s", text);
+}
+
+static const char*
+overflowPolicyName(OverflowPolicy policy)
+{
+	switch (policy) {
+	 case OverflowPolicy::Block:      return "block";
+	 case OverflowPolicy::DropOldest: return "drop-oldest";
+	 case OverflowPolicy::DropOutput: return "drop-output";
+	}
+	return "<unknown>";
 }
 
 static void
 addOutput(int clientfd, const vector<string>& args)
 {
 	bool skip_announce = false;
+	OverflowPolicy overflow = OverflowPolicy::Block;
+	size_t queue_size = kDefaultOutputQueueSize;
+	uint16_t protocol = 0;
+	bool reply = false;
 	size_t at = 2;
-	if (args.size() > at && args[at] == "--resume") {
-		++at;
-		skip_announce = true;
+	for (; args.size() > at; ++at) {
+		const string& arg = args[at];
+		if (arg == "--resume") {
+			skip_announce = true;
+		} else if (arg == "--reply") {
+			reply = true;
+		} else if (arg.compare(0, 11, "--overflow=") == 0) {
+			overflow = parseOverflowPolicy(arg.c_str() + 11);
+		} else if (arg.compare(0, 13, "--queue-size=") == 0) {
+			unsigned long value;
+			if (!parseULong(&value, arg.c_str() + 13, size_t(-1)))
+				throw MsgException("bad queue size: %s",
+				                   arg.c_str() + 13);
+			queue_size = value;
+		} else if (arg.compare(0, 11, "--protocol=") == 0) {
+			unsigned long value;
+			if (!parseULong(&value, arg.c_str() + 11, size_t(-1)) ||
+			    value < kNE2Version || value > kNE3Version)
+				throw MsgException("bad protocol version: %s",
+				                   arg.c_str() + 11);
+			protocol = uint16_t(value);
+		} else {
+			break;
+		}
 	}
 
 	if (at+1 >= args.size())
@@ -687,7 +2734,8 @@ addOutput(int clientfd, const vector<string>& args)
 	const string& name = args[at++];
 
 	string cmd = join(' ', args.begin()+ssize_t(at), args.end());
-	addOutput(name, cmd.c_str(), skip_announce);
+	addOutput(name, cmd.c_str(), skip_announce, overflow, queue_size,
+	          protocol, reply);
 	toClient(clientfd, "added output %s\n", name.c_str());
 }
 
@@ -740,8 +2788,8 @@ removeHotkey(uint16_t device, uint16_t type, uint16_t code, int32_t value)
 	gHotkeys.erase(HotkeyDef{device, type, code, value});
 }
 
-static void
-shellCommand(const char *cmd, bool background)
+static pid_t
+startShellCommand(const char *cmd)
 {
 	pid_t pid = ::fork();
 	if (pid == -1)
@@ -752,13 +2800,21 @@ shellCommand(const char *cmd, bool background)
 		::perror("exec() failed");
 		::exit(-1);
 	}
+	return pid;
+}
+
+static void
+shellCommand(const char *cmd, bool background)
+{
+	pid_t pid = startShellCommand(cmd);
 	if (background)
 		return;
 
+	// ECHILD if the SIGCHLD handler, possibly on another thread, was faster
 	int status = 0;
-	do {
+	while (::waitpid(pid, &status, 0) != pid && errno == EINTR) {
 		// wait
-	} while (::waitpid(pid, &status, 0) != pid);
+	}
 }
 
 static inline constexpr bool
@@ -851,6 +2907,33 @@ clientCommand_Device(int clientfd, const vector<string>& args)
 		toClient(clientfd, "reset name of device %s\n",
 		         dev->realName().c_str());
 	}
+	else if (args[1] == "route") {
+		if (args.size() != 4)
+			throw Exception(
+			    "'device route' requires a device and an output"
+			    " or '-'");
+		auto iter = gInputs.find(args[2]);
+		if (iter == gInputs.end())
+			throw MsgException("no such device: %s",
+			                   args[2].c_str());
+		Input& input = iter->second;
+		Output *out = nullptr;
+		if (args[3] != "-") {
+			auto oi = gOutputs.find(args[3]);
+			if (oi == gOutputs.end())
+				throw MsgException("no such output: %s",
+				                   args[3].c_str());
+			out = &oi->second;
+		}
+		// don't send the rest of a frame to the new output
+		if (out != inputTarget(input))
+			input.frame_.clear();
+		input.route_ = out ? args[3] : string();
+		input.routeOutput_ = out;
+		toClient(clientfd, "device %s routed to %s\n",
+		         args[2].c_str(),
+		         out ? args[3].c_str() : "the current output");
+	}
 	else if (args[1] == "set-persistent") {
 		if (args.size() != 4)
 			throw Exception(
@@ -903,6 +2986,22 @@ clientCommand_Output(int clientfd, const vector<string>& args)
 		toClient(clientfd, "output = %s\n",
 		         gCurrentOutput.name.c_str());
 	}
+	else if (args[1] == "mirror") {
+		if (args.size() != 4)
+			throw Exception(
+			    "'output mirror' requires a name and a boolean");
+		auto iter = gOutputs.find(args[2]);
+		if (iter == gOutputs.end())
+			throw MsgException("no such output: %s",
+			                   args[2].c_str());
+		bool on;
+		if (!parseBool(&on, args[3].c_str()))
+			throw MsgException("not a boolean: '%s'",
+			                   args[3].c_str());
+		mirrorOutput(iter->second, on);
+		toClient(clientfd, "mirroring to %s: %s\n",
+		         args[2].c_str(), on ? "on" : "off");
+	}
 	else
 		throw MsgException("unknown output subcommand: %s",
 		                   args[1].c_str());
@@ -1017,20 +3116,94 @@ clientCommand_Info(int clientfd, const vector<string>& args)
 
 	toClient(clientfd, "Grab-devices: %s\n", gGrab ? "on" : "off");
 	toClient(clientfd, "Write-events: %s\n", gWrite ? "on" : "off");
+	toClient(clientfd, "Frame-batching: %s\n",
+	         gFrameBatching ? "on" : "off");
+	if (gBusyPoll.budget) {
+		uint64_t elapsed = nowNS(CLOCK_MONOTONIC) - gBusyPoll.enabledAt;
+		toClient(clientfd,
+		         "Busy-poll: %lu us (spinning: %" PRIu64 " ms, %.1f%%"
+		         " of one cpu, hits: %" PRIu64 ", misses: %" PRIu64 ")\n",
+		         gBusyPoll.budget, gBusyPoll.spinTime / 1000000,
+		         elapsed ? 100.0 * double(gBusyPoll.spinTime) /
+		                   double(elapsed) : 0.0,
+		         gBusyPoll.hits, gBusyPoll.misses);
+	} else {
+		toClient(clientfd, "Busy-poll: off\n");
+	}
+	if (gKeepAlive.interval)
+		toClient(clientfd, "Keepalive: %lu s\n", gKeepAlive.interval);
+	else
+		toClient(clientfd, "Keepalive: off\n");
+	if (gOutputTimeout.timeout)
+		toClient(clientfd, "Output-timeout: %lu ms\n",
+		         gOutputTimeout.timeout);
+	else
+		toClient(clientfd, "Output-timeout: off\n");
+	for (int spun = 0; spun != 2; ++spun) {
+		const auto& lat = gBusyPoll.latency[spun];
+		toClient(clientfd,
+		         "Latency after %s: %" PRIu64 " us average over %"
+		         PRIu64 " reads\n",
+		         spun ? "spinning" : "sleeping",
+		         lat.count ? lat.total / lat.count / 1000 : 0,
+		         lat.count);
+	}
 	toClient(clientfd, "Inputs: %zu\n", gInputs.size());
 	for (auto& i: gInputs) {
-		toClient(clientfd, "    %u: %s: %i\n",
-		         i.second.id_,
+		const Input& input = i.second;
+		toClient(clientfd, "    %u: %s: %i%s%s\n",
+		         input.id_,
 		         i.first.c_str(),
-		         i.second.device_->fd());
+		         input.device_->fd(),
+		         input.route_.empty() ? "" : " -> ",
+		         input.route_.c_str());
 	}
 
 	toClient(clientfd, "Outputs: %zu\n", gOutputs.size());
 	for (auto& i: gOutputs) {
-		toClient(clientfd, "    %s: %i\n",
+		const Output& out = i.second;
+		bool mirror = std::find(gMirrorOutputs.begin(),
+		                        gMirrorOutputs.end(),
+		                        &out) != gMirrorOutputs.end();
+		toClient(clientfd,
+		         "    %s: %i (protocol: %u%s, overflow: %s,"
+		         " queued: %zu/%zu, dropped frames: %zu%s%s)\n",
 		         i.first.c_str(),
-		         i.second.fd());
+		         out.fd(),
+		         out.protocol_,
+		         (eventEncoding(out) == EventEncoding::NE2Frames)
+		             ? " with frames" : "",
+		         overflowPolicyName(out.overflow_),
+		         out.queued_, out.queueLimit_,
+		         out.dropped_,
+		         out.tls_ ? (out.tlsResumed_ ? ", tls resumed"
+		                                     : ", tls") : "",
+		         mirror ? ", mirror" : "");
+		const auto& rtt = out.rtt_;
+		if (rtt.count) {
+			toClient(clientfd,
+			         "        rtt: %.3f ms (min %.3f, avg %.3f,"
+			         " max %.3f), unanswered keepalives: %u\n",
+			         double(rtt.last) / 1e6,
+			         double(rtt.min) / 1e6,
+			         double(rtt.total / rtt.count) / 1e6,
+			         double(rtt.max) / 1e6,
+			         out.keepAliveSent_ - out.keepAliveAnswered_);
+			if (out.clockSampleCount_)
+				toClient(clientfd,
+				         "        clock offset: %.3f ms\n",
+				         double(out.clockOffset_) / 1e6);
+		} else if (out.listening_ && out.keepAliveSent_) {
+			toClient(clientfd,
+			         "        rtt: unknown, unanswered keepalives:"
+			         " %u\n", out.keepAliveSent_);
+		}
 	}
+#ifdef HAS_TLS
+	for (auto& i: gPendingOutputs)
+		toClient(clientfd, "    %s: tls handshake in progress\n",
+		         i.first.c_str());
+#endif
 
 	toClient(clientfd, "Current output: %i: %s\n",
 	         gCurrentOutput.fd, gCurrentOutput.name.c_str());
@@ -1090,6 +3263,53 @@ clientCommand_Action(int clientfd, const vector<string>& args)
 		                   cmd.c_str());
 }
 
+static void
+clientCommand_Set(int clientfd, const vector<string>& args)
+{
+	if (args.size() != 3)
+		throw Exception("'set' requires a name and a value");
+	const string& name = args[1];
+	const char *value = args[2].c_str();
+
+	if (name == "frame-batching") {
+		if (!parseBool(&gFrameBatching, value))
+			throw MsgException("not a boolean: '%s'", value);
+		toClient(clientfd, "frame-batching = %s\n",
+		         gFrameBatching ? "on" : "off");
+	}
+	else if (name == "busy-poll") {
+		unsigned long budget;
+		if (!parseULong(&budget, value, size_t(-1)))
+			throw MsgException("not a number: '%s'", value);
+		if (usingURing())
+			throw Exception("busy polling requires the epoll loop");
+		if (budget && !gBusyPoll.budget) {
+			gBusyPoll.enabledAt = nowNS(CLOCK_MONOTONIC);
+			gBusyPoll.spinTime = 0;
+			gBusyPoll.hits = 0;
+			gBusyPoll.misses = 0;
+		}
+		gBusyPoll.budget = budget;
+		toClient(clientfd, "busy-poll = %lu us\n", budget);
+	}
+	else if (name == "output-timeout") {
+		unsigned long timeout;
+		if (!parseULong(&timeout, value, size_t(-1)))
+			throw MsgException("not a number: '%s'", value);
+		setOutputTimeout(timeout);
+		toClient(clientfd, "output-timeout = %lu ms\n", timeout);
+	}
+	else if (name == "keepalive") {
+		unsigned long interval;
+		if (!parseULong(&interval, value, size_t(-1)))
+			throw MsgException("not a number: '%s'", value);
+		setKeepAlive(interval);
+		toClient(clientfd, "keepalive = %lu s\n", interval);
+	}
+	else
+		throw MsgException("unknown setting: %s", name.c_str());
+}
+
 static void sourceCommandFile(int clientfd, const char *path);
 static void
 clientCommand(int clientfd, const vector<string>& args)
@@ -1108,6 +3328,8 @@ clientCommand(int clientfd, const vector<string>& args)
 		clientCommand_Action(clientfd, args);
 	else if (args[0] == "info")
 		clientCommand_Info(clientfd, args);
+	else if (args[0] == "set")
+		clientCommand_Set(clientfd, args);
 	else if (args[0] == "write-events") {
 		if (args.size() != 2)
 			throw Exception("'write-events' requires 1 parameter");
@@ -1160,6 +3382,20 @@ clientCommand(int clientfd, const vector<string>& args)
 	toClient(clientfd, "Ok.\n");
 }
 
+// With --threads the main loop does not wait for `exec` commands: the
+// control thread does, and queues the rest of the command line afterwards.
+static bool
+deferCommand(int clientfd, const vector<string>& args, const char *rest,
+             const char *end)
+{
+	if (!gControl || gSourceDepth || args.size() < 2 || args[0] != "exec")
+		return false;
+	string cmd = join(' ', args.begin()+1, args.end());
+	gControl->waitFor(startShellCommand(cmd.c_str()), clientfd,
+	                  string(rest, end));
+	return true;
+}
+
 static void
 parseClientCommand(int clientfd, const char *cmd, size_t length)
 {
@@ -1185,6 +3421,9 @@ parseClientCommand(int clientfd, const char *cmd, size_t length)
 			} else if (*cmd == ';') {
 				++cmd;
 				if (!args.empty()) {
+					if (deferCommand(clientfd, args,
+					                 cmd, end))
+						return;
 					clientCommand(clientfd, args);
 					args.clear();
 				}
@@ -1215,7 +3454,7 @@ parseClientCommand(int clientfd, const char *cmd, size_t length)
 		escape = false;
 	}
 
-	if (!args.empty())
+	if (!args.empty() && !deferCommand(clientfd, args, end, end))
 		clientCommand(clientfd, args);
 }
 
@@ -1231,6 +3470,8 @@ processCommandQueue()
 			toClient(command.client_,
 			        "ERROR: %s\n", ex.what());
 		}
+		if (gControl && command.client_ >= 0)
+			gControl->finished(command.client_);
 	}
 	gCommandQueue.clear();
 }
@@ -1243,7 +3484,9 @@ sourceCommandFile(int clientfd, const char *path)
 		throw ErrnoException("open(%s)", path);
 	char *line = nullptr;
 
+	++gSourceDepth;
 	scope (exit) {
+		--gSourceDepth;
 		::fclose(file);
 		::free(line);
 	};
@@ -1291,16 +3534,51 @@ signull(int sig)
 	}
 }
 
+// Spin for up to the busy-poll budget before going to sleep, so new events
+// don't have to wait for the scheduler to wake us up.
+static int
+waitForEvents(int epfd, struct epoll_event *events, int count)
+{
+	gBusyPoll.spinning = false;
+	if (gBusyPoll.budget) {
+		uint64_t start = nowNS(CLOCK_MONOTONIC);
+		uint64_t deadline = start + gBusyPoll.budget * 1000;
+		uint64_t now;
+		do {
+			int got = ::epoll_wait(epfd, events, count, 0);
+			if (got != 0) {
+				gBusyPoll.spinTime += nowNS(CLOCK_MONOTONIC) - start;
+				if (got > 0) {
+					++gBusyPoll.hits;
+					gBusyPoll.spinning = true;
+				}
+				return got;
+			}
+			now = nowNS(CLOCK_MONOTONIC);
+		} while (now < deadline);
+		gBusyPoll.spinTime += now - start;
+		++gBusyPoll.misses;
+	}
+	return ::epoll_wait(epfd, events, count, -1);
+}
+
 int
 cmd_daemon(int argc, char **argv)
 {
 	static struct option longopts[] = {
 		{ "help",   no_argument,       nullptr, 'h' },
 		{ "source", required_argument, nullptr, 's' },
+		{ "io-uring", no_argument,     nullptr, 'U' },
+		{ "threads",  no_argument,     nullptr, 'T' },
+		{ "realtime", optional_argument, nullptr, 0x1000 },
+		{ "cpu",      required_argument, nullptr, 0x1001 },
+		{ "mlock",    no_argument,     nullptr, 0x1002 },
 		{ nullptr, 0, nullptr, 0 }
 	};
 
 	vector<const char*> command_files;
+	bool use_uring = false;
+	SchedOptions sched;
 
 	int c, optindex = 0;
 	opterr = 1;
@@ -1316,6 +3594,20 @@ cmd_daemon(int argc, char **argv)
 		 case 's':
 			command_files.push_back(optarg);
 			break;
+		 case 'T':
+			gThreaded = true;
+			break;
+		 case 0x1000: sched.parseRealtime(optarg); break;
+		 case 0x1001: sched.parseCPUs(optarg); break;
+		 case 0x1002: sched.lockMemory(); break;
+		 case 'U':
+#ifdef HAS_IO_URING
+			use_uring = true;
+			break;
+#else
+			::fprintf(stderr, "netevent was built without io_uring support\n");
+			return 2;
+#endif
 		 case '?':
 			break;
 		 default:
@@ -1331,6 +3623,9 @@ cmd_daemon(int argc, char **argv)
 
 	const char *sockname = argv[optind++];
 
+	// device reader threads inherit all of this
+	sched.apply();
+
 	signal(SIGINT, signull);
 	signal(SIGTERM, signull);
 	signal(SIGQUIT, signull);
@@ -1345,88 +3640,101 @@ cmd_daemon(int argc, char **argv)
 		server.listenUnix<false>(sockname);
 	}
 
-	vector<struct pollfd> pfds;
-	pfds.resize(1);
-	pfds[0].fd = server.fd();
-
-	gFDCBs[server.fd()] = FDCallbacks {
-		[&]() { newCommandClient(server); },
-		[ ]() { gQuit = true; },
-		[ ]() { gQuit = true; },
-		[ ]() { throw Exception("removed server socket"); },
-	};
+	int epfd = -1;
+#ifdef HAS_IO_URING
+	if (use_uring)
+		gURing.reset(new URing { 256 });
+	else
+#endif
+	{
+		epfd = ::epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			throw ErrnoException("failed to create epoll instance");
+		gEpoll = IOHandle { epfd };
+	}
 
-	for (auto& i: pfds) {
-		i.events = POLLIN | POLLHUP | POLLERR;
-		i.revents = 0;
+	if (gThreaded) {
+		// Children exiting are no reason to interrupt the main loop,
+		// every thread but the control thread inherits this.
+		sigset_t sigchld;
+		::sigemptyset(&sigchld);
+		::sigaddset(&sigchld, SIGCHLD);
+		(void)::pthread_sigmask(SIG_BLOCK, &sigchld, nullptr);
+		gControl.reset(new ControlThread { server });
+		addFD(gControl->fd(), FDCallbacks {
+			[ ]() { gControl->takeCommands(gCommandQueue); },
+			nullptr,
+			[ ]() { gQuit = true; },
+			[ ]() { gQuit = true; },
+			[ ]() { throw Exception("removed control thread"); },
+		});
+	} else {
+		addFD(server.fd(), FDCallbacks {
+			[&]() { newCommandClient(server); },
+			nullptr,
+			[ ]() { gQuit = true; },
+			[ ]() { gQuit = true; },
+			[ ]() { throw Exception("removed server socket"); },
+		});
 	}
 
 	for (auto file: command_files)
 		sourceCommandFile(-1, file);
 	command_files.clear();
 	command_files.shrink_to_fit();
+
+	struct epoll_event events[64];
 	while (!gQuit) {
 		processCommandQueue();
-
-		if (!gFDAddQueue.empty()) {
-			pfds.insert(pfds.end(), gFDAddQueue.begin(),
-			            gFDAddQueue.end());
-			gFDAddQueue.clear();
-		}
-
-		pfds.erase(
-		    std::remove_if(pfds.begin(), pfds.end(),
-		        [](struct pollfd& pfd) {
-		            return std::find(gFDRemoveQueue.begin(),
-		                             gFDRemoveQueue.end(),
-		                             pfd.fd)
-		                != gFDRemoveQueue.end();
-		        }
-		    ),
-		    pfds.end());
 		processRemoveQueue();
 
 		// after processing commands, we may want to quit:
 		if (gQuit)
 			break;
 
-		auto got = ::poll(pfds.data(), nfds_t(pfds.size()), -1);
+#ifdef HAS_IO_URING
+		if (gURing) {
+			uringSubmitOutputs();
+			uringLoopIteration();
+			continue;
+		}
+#endif
+
+		auto got = waitForEvents(epfd, events,
+		                         sizeof(events)/sizeof(events[0]));
 		if (got == -1) {
 			if (errno == EINTR) {
 				::fprintf(stderr, "interrupted\n");
 				continue;
 			}
-			throw ErrnoException("poll interrupted");
+			throw ErrnoException("epoll_wait interrupted");
 		}
 		if (!got)
 			::fprintf(stderr, "empty poll?\n");
 
-		for (auto& i: pfds) {
-			auto cbs = gFDCBs.find(i.fd);
-			auto revents = i.revents;
-			i.revents = 0;
-
-			if (cbs == gFDCBs.end())
-				throw Exception(
-				    "internal: callback map broken");
-
-			if (revents & POLLERR)
-				cbs->second.onError();
-			if (gQuit) break;
-			if (revents & POLLHUP)
-				cbs->second.onHUP();
-			if (gQuit) break;
-			if (revents & POLLIN)
-				cbs->second.onRead();
-			if (gQuit) break;
-		}
+		for (int i = 0; i != got; ++i) {
+			auto entry = reinterpret_cast<FDEntry*>(
+			    events[i].data.ptr);
+
+			// removed by a previous callback
+			if (entry->removing)
+				continue;
 
+			if (!dispatchEvents(entry, events[i].events))
+				break;
+		}
 	}
 	::fprintf(stderr, "shutting down\n");
 
+	gControl.reset();
 	gFDRemoveQueue.clear();
-	gFDCBs.clear();          // destroy possible captures
+#ifdef HAS_IO_URING
+	gURing.reset();          // the kernel must not touch our buffers anymore
+	gDeferredCQEs.clear();
+#endif
+	gFDEntries.clear();      // destroy possible captures
 	gCommandClients.clear(); // disconnect all clients
+	gEpoll.close();
 
 	return 0;
 }
@@ -0,0 +1,173 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "decoder.h"
+#include "ne3.h"
+
+NE2Decoder::NE2Decoder(size_t capacity)
+	: buffer_(capacity)
+{
+}
+
+ssize_t
+NE2Decoder::fill(int fd)
+{
+	auto buf = space();
+	ssize_t got = ::read(fd, buf.data(), buf.size());
+	if (got > 0)
+		filled(size_t(got));
+	return got;
+}
+
+Span<uint8_t>
+NE2Decoder::space()
+{
+	return { buffer_.data() + end_, buffer_.size() - end_ };
+}
+
+void
+NE2Decoder::filled(size_t count)
+{
+	end_ += count;
+}
+
+bool
+NE2Decoder::next(NE2Packet *pkt, Span<const uint8_t> *descriptor)
+{
+	*descriptor = {};
+	if (framePos_ != frame_.size() || version_ < kNE3Version)
+		return nextPacket(0, pkt, descriptor);
+	if (start_ == end_)
+		return incomplete();
+	switch (buffer_[start_]) {
+	 case kNE3Packet:
+		return nextPacket(1, pkt, descriptor);
+	 case kNE3Frame:
+		return nextFrame(pkt);
+	 default:
+		throw MsgException("protocol error: unknown record type %u",
+		                   buffer_[start_]);
+	}
+}
+
+// A packet in the version 2 format, `offset` bytes into the buffer.
+bool
+NE2Decoder::nextPacket(size_t offset, NE2Packet *pkt,
+                       Span<const uint8_t> *descriptor)
+{
+	if (framePos_ != frame_.size()) {
+		::memset(reinterpret_cast<void*>(pkt), 0, sizeof(*pkt));
+		pkt->cmd = htobe16(uint16_t(NE2Command::DeviceEvent));
+		pkt->event.id = htobe16(frameDevice_);
+		pkt->event.event = frame_[framePos_++];
+		pkt->event.event.toNet();
+		return true;
+	}
+
+	size_t avail = end_ - start_;
+	if (avail < offset + sizeof(*pkt))
+		return incomplete();
+	const uint8_t *data = buffer_.data() + start_ + offset;
+	avail -= offset;
+	::memcpy(reinterpret_cast<void*>(pkt), data, sizeof(*pkt));
+
+	if (be16toh(pkt->cmd) == uint16_t(NE2Command::DeviceFrame))
+		return deviceFrame(offset, pkt);
+	if (be16toh(pkt->cmd) != uint16_t(NE2Command::AddDevice)) {
+		start_ += offset + sizeof(*pkt);
+		return true;
+	}
+
+	NE2Packet host = *pkt;
+	host.cmd = be16toh(host.cmd);
+	host.add_device.dev_info_size = be16toh(host.add_device.dev_info_size);
+	host.add_device.dev_name_size = be16toh(host.add_device.dev_name_size);
+	size_t size = OutDevice::ne2DescriptorSize(host,
+	    { data + sizeof(*pkt), avail - sizeof(*pkt) });
+	if (!size)
+		return incomplete();
+	*descriptor = { data + sizeof(*pkt), size };
+	start_ += offset + sizeof(*pkt) + size;
+	return true;
+}
+
+// A DeviceFrame packet is complete with all of its events.
+bool
+NE2Decoder::deviceFrame(size_t offset, NE2Packet *pkt)
+{
+	size_t count = be16toh(pkt->frame.count);
+	size_t size = offset + sizeof(*pkt) + count * sizeof(NE2FrameEvent);
+	if (end_ - start_ < size)
+		return incomplete();
+	const uint8_t *data = buffer_.data() + start_ + offset + sizeof(*pkt);
+	start_ += size;
+
+	frameDevice_ = be16toh(pkt->frame.id);
+	frame_.resize(count);
+	for (auto& ev : frame_) {
+		NE2FrameEvent fev;
+		::memcpy(&fev, data, sizeof(fev));
+		data += sizeof(fev);
+		ev.tv_sec = be64toh(pkt->frame.tv_sec);
+		ev.tv_usec = be32toh(pkt->frame.tv_usec);
+		ev.type = be16toh(fev.type);
+		ev.code = be16toh(fev.code);
+		ev.value = static_cast<int32_t>(be32toh(uint32_t(fev.value)));
+	}
+	framePos_ = 0;
+	Span<const uint8_t> unused;
+	return next(pkt, &unused);
+}
+
+bool
+NE2Decoder::nextFrame(NE2Packet *pkt)
+{
+	uint16_t id;
+	size_t size = decodeNE3Frame(
+	    { buffer_.data() + start_, end_ - start_ }, &id, frame_);
+	framePos_ = 0;
+	if (!size) {
+		// the partially decoded events are not to be handed out
+		frame_.clear();
+		return incomplete();
+	}
+	start_ += size;
+	frameDevice_ = id;
+	Span<const uint8_t> unused;
+	return next(pkt, &unused);
+}
+
+bool
+NE2Decoder::incomplete()
+{
+	// Device descriptors and frames are much smaller than the default
+	// capacity, but make sure one always fits.
+	if (start_ == 0 && end_ == buffer_.size())
+		buffer_.resize(buffer_.size() * 2);
+	compact();
+	return false;
+}
+
+void
+NE2Decoder::reset()
+{
+	start_ = end_ = 0;
+	version_ = kNE2Version;
+	frame_.clear();
+	framePos_ = 0;
+}
+
+// Move the partial packet at the end to the front to make room.
+void
+NE2Decoder::compact()
+{
+	if (!start_)
+		return;
+	::memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
+	end_ -= start_;
+	start_ = 0;
+}
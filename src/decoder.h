@@ -0,0 +1,65 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include <vector>
+
+#include "main.h"
+
+// Buffered decoder for netevent 2 streams: the data is read in large chunks
+// and all complete packets in it are handed out. An AddDevice packet is only
+// complete once its whole device descriptor is available, so the decoder
+// never has to block in the middle of a packet.
+// DeviceFrame packets and version 3 event frames are handed out as individual
+// DeviceEvent packets.
+struct NE2Decoder {
+	static constexpr size_t kDefaultCapacity = 64 * 1024;
+
+	NE2Decoder(const NE2Decoder&) = delete;
+	explicit NE2Decoder(size_t capacity = kDefaultCapacity);
+
+	// Read into the free buffer space with a single read() call, returns
+	// the result of the read() call.
+	ssize_t fill(int fd);
+	// For reading via other means (io_uring): the free buffer space, and
+	// the amount of data which was put into it.
+	Span<uint8_t> space();
+	void filled(size_t count);
+
+	// Returns false if there is no complete packet left. The packet is in
+	// network byte order. For AddDevice packets the descriptor refers to
+	// the buffer and stays valid until the next call.
+	bool next(NE2Packet *pkt, Span<const uint8_t> *descriptor);
+
+	// Drop all buffered data, eg. when switching to a new client.
+	void reset();
+
+	// The protocol version of the following data, changed by the user
+	// when receiving a Hello packet.
+	void version(uint16_t version) noexcept {
+		version_ = version;
+	}
+
+ private:
+	bool nextPacket(size_t offset, NE2Packet *pkt,
+	                Span<const uint8_t> *descriptor);
+	bool deviceFrame(size_t offset, NE2Packet *pkt);
+	bool nextFrame(NE2Packet *pkt);
+	bool incomplete();
+	void compact();
+
+ private:
+	std::vector<uint8_t> buffer_;
+	size_t start_ = 0;
+	size_t end_ = 0;
+	uint16_t version_ = kNE2Version;
+	// the events of the current DeviceFrame packet or version 3 frame
+	uint16_t frameDevice_ = 0;
+	std::vector<InputEvent> frame_;
+	size_t framePos_ = 0;
+};
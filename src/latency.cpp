@@ -0,0 +1,65 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <algorithm>
+
+#include "latency.h"
+
+LatencyReport::LatencyReport(unsigned long interval)
+	: interval_(interval * 1000000000ULL)
+	, start_(nowNS(CLOCK_MONOTONIC))
+{
+}
+
+void
+LatencyReport::record(const InputEvent& ev)
+{
+	if (samples_.size() == kMaxSamples) {
+		++dropped_;
+		return;
+	}
+	int64_t stamp = int64_t(ev.tv_sec * 1000000000ULL +
+	                        ev.tv_usec * 1000ULL);
+	int64_t now = int64_t(nowNS(CLOCK_REALTIME));
+	samples_.push_back(now - (stamp - offset_));
+}
+
+void
+LatencyReport::tick(bool force)
+{
+	uint64_t now = nowNS(CLOCK_MONOTONIC);
+	if (!force && now - start_ < interval_)
+		return;
+	start_ = now;
+	if (!samples_.empty())
+		print();
+	samples_.clear();
+	dropped_ = 0;
+}
+
+void
+LatencyReport::print()
+{
+	std::sort(samples_.begin(), samples_.end());
+	auto at = [&](double percentile) {
+		size_t i = size_t(double(samples_.size() - 1) * percentile);
+		return double(samples_[i]) / 1e6;
+	};
+	::fprintf(stderr,
+	          "latency over %zu events: p50 %.3f ms, p90 %.3f ms,"
+	          " p99 %.3f ms, p99.9 %.3f ms, max %.3f ms",
+	          samples_.size(), at(0.5), at(0.9), at(0.99), at(0.999),
+	          double(samples_.back()) / 1e6);
+	if (offsetKnown_)
+		::fprintf(stderr, " (clock offset %.3f ms)",
+		          double(offset_) / 1e6);
+	else
+		::fprintf(stderr, " (clock offset unknown)");
+	if (dropped_)
+		::fprintf(stderr, ", %zu events not measured", dropped_);
+	::fputc('\n', stderr);
+}
@@ -0,0 +1,49 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "main.h"
+
+// End-to-end latency of the received events: from their timestamp, which is
+// the sending machine's CLOCK_REALTIME, until they are handed to uinput.
+// Percentiles are printed at a fixed interval. The offset between the two
+// clocks comes from the sender's keepalives, until then the clocks are
+// assumed to be in sync.
+struct LatencyReport {
+	LatencyReport(const LatencyReport&) = delete;
+	// interval in seconds
+	explicit LatencyReport(unsigned long interval);
+
+	// The sender's CLOCK_REALTIME minus ours, in nanoseconds.
+	void offset(int64_t offset) noexcept {
+		offset_ = offset;
+		offsetKnown_ = true;
+	}
+
+	void record(const InputEvent& ev);
+	// Print the report if the interval is over, or right away when forced.
+	void tick(bool force = false);
+
+ private:
+	void print();
+
+ private:
+	// enough for a few thousand events per second over a minute
+	static const size_t kMaxSamples = 1024 * 1024;
+
+	uint64_t interval_;
+	uint64_t start_;
+	int64_t offset_ = 0;
+	bool offsetKnown_ = false;
+	std::vector<int64_t> samples_;
+	size_t dropped_ = 0;
+};
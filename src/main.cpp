@@ -6,67 +6,32 @@
  * SPDX-License-Identifier: GPL-2.0-or-later
  */
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 using std::map;
 
 #include "main.h"
+#include "decoder.h"
+#include "latency.h"
+#include "uring.h"
+#include "tls.h"
 
 #pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
 
-const char*
-Exception::what() const noexcept {
-	return msg_;
-}
-
-DeviceException::DeviceException(const char *msg)
-	: Exception(msg)
-{}
-
-MsgException::MsgException(MsgException&& o)
-	: Exception(msgbuf_) // we have to copy instead of moving
-{
-	::strncpy(msgbuf_, o.msgbuf_, sizeof(msgbuf_));
-}
-
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wformat-nonliteral"
-MsgException::MsgException(const char *msg, ...)
-	: Exception(msgbuf_)
-{
-	va_list ap;
-	va_start(ap, msg);
-	::vsnprintf(msgbuf_, sizeof(msgbuf_), msg, ap);
-	va_end(ap);
-}
-
-ErrnoException::ErrnoException(ErrnoException&& o)
-	: Exception(msgbuf_) // we have to copy instead of moving
-{
-	::strncpy(msgbuf_, o.msgbuf_, sizeof(msgbuf_));
-	errno_ = o.errno_;
-}
-
-ErrnoException::ErrnoException(const char *msg, ...)
-	: Exception(msgbuf_)
-{
-	errno_ = errno;
-	va_list ap;
-	va_start(ap, msg);
-	int end = ::vsnprintf(msgbuf_, sizeof(msgbuf_), msg, ap);
-	va_end(ap);
-	if (end < 0)
-		end = 0;
-	::snprintf(msgbuf_ + end,
-	           sizeof(msgbuf_)-size_t(end),
-	           ": %s", ::strerror(errno_));
-	msgbuf_[sizeof(msgbuf_)-1] = 0;
-}
-#pragma clang diagnostic pop
-
 static void
 usage [[noreturn]] (FILE *out, int exit_status)
 {
@@ -234,14 +199,23 @@ String2EV(const char* text, size_t length)
 	return unsigned(-1);
 }
 
-void
-writeHello(int fd)
+NE2Packet
+makeHello(uint16_t version, uint16_t max_version, uint16_t features)
 {
 	NE2Packet pkt = {};
 	::memset(reinterpret_cast<void*>(&pkt), 0, sizeof(pkt));
 	pkt.cmd = htobe16(uint16_t(NE2Command::Hello));
 	::memcpy(pkt.hello.magic, kNE2Hello, sizeof(pkt.hello.magic));
-	pkt.hello.version = htobe16(kNE2Version);
+	pkt.hello.version = htobe16(version);
+	pkt.hello.max_version = htobe16(max_version);
+	pkt.hello.features = htobe16(features);
+	return pkt;
+}
+
+void
+writeHello(int fd)
+{
+	NE2Packet pkt = makeHello();
 	if (!mustWrite(fd, &pkt, sizeof(pkt)))
 		throw ErrnoException("failed to write hello packet");
 }
@@ -257,10 +231,12 @@ checkHello(NE2Packet& pkt)
 		throw MsgException("protocol error: bad hello packet magic");
 	}
 	pkt.hello.version = be16toh(pkt.hello.version);
-	if (pkt.hello.version != kNE2Version)
+	pkt.hello.max_version = be16toh(pkt.hello.max_version);
+	pkt.hello.features = be16toh(pkt.hello.features);
+	if (pkt.hello.version < kNE2Version || pkt.hello.version > kNE3Version)
 		throw MsgException(
-		    "protocol version mismatch: got %u, expected %u\n",
-		    pkt.hello.version, kNE2Version);
+		    "protocol version mismatch: got %u, expected %u to %u\n",
+		    pkt.hello.version, kNE2Version, kNE3Version);
 }
 
 static void
@@ -273,6 +249,148 @@ readHello(int fd)
 	checkHello(pkt);
 }
 
+// POLICY[:PRIORITY] with the policy being fifo or rr.
+void
+SchedOptions::parseRealtime(const char *arg)
+{
+	policy_ = SCHED_FIFO;
+	priority_ = 10;
+	if (!arg)
+		return;
+
+	const char *colon = ::strchr(arg, ':');
+	size_t len = colon ? size_t(colon - arg) : ::strlen(arg);
+	if (len == 4 && !::strncasecmp(arg, "fifo", 4))
+		policy_ = SCHED_FIFO;
+	else if (len == 2 && !::strncasecmp(arg, "rr", 2))
+		policy_ = SCHED_RR;
+	else if (len)
+		throw MsgException("unknown scheduling policy: %.*s",
+		                   int(len), arg);
+
+	if (colon) {
+		unsigned long prio;
+		int min = ::sched_get_priority_min(policy_);
+		int max = ::sched_get_priority_max(policy_);
+		if (!parseULong(&prio, colon+1, size_t(-1)) ||
+		    prio < unsigned(min) || prio > unsigned(max))
+		{
+			throw MsgException("invalid priority, must be %i to %i",
+			                   min, max);
+		}
+		priority_ = int(prio);
+	}
+}
+
+// Comma separated list of CPUs and CPU ranges, eg. 0,2-3
+void
+SchedOptions::parseCPUs(const char *arg)
+{
+	CPU_ZERO(&cpus_);
+	while (*arg) {
+		size_t len = ::strcspn(arg, ",");
+		const char *dash = ::strchr(arg, '-');
+		if (dash && dash >= arg + len)
+			dash = nullptr;
+
+		unsigned long first, last;
+		if (!parseULong(&first, arg,
+		                dash ? size_t(dash - arg) : len) ||
+		    (dash && !parseULong(&last, dash+1,
+		                         len - size_t(dash+1 - arg))))
+		{
+			throw MsgException("invalid cpu list: %s", arg);
+		}
+		if (!dash)
+			last = first;
+		if (first > last || last >= CPU_SETSIZE)
+			throw MsgException("invalid cpu range: %.*s",
+			                   int(len), arg);
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, &cpus_);
+
+		arg += len;
+		if (*arg == ',')
+			++arg;
+	}
+	pinned_ = true;
+}
+
+// What apply() changed, for resetChild(). Threads created after apply()
+// inherit the policy and affinity, which is what we want, so this cannot
+// use SCHED_RESET_ON_FORK.
+static cpu_set_t gInheritedCPUs;
+static bool gSchedPinned = false;
+static bool gSchedRealtime = false;
+
+void
+SchedOptions::apply() const
+{
+	if (pinned_) {
+		if (::sched_getaffinity(0, sizeof(gInheritedCPUs),
+		                        &gInheritedCPUs) != 0)
+		{
+			CPU_ZERO(&gInheritedCPUs);
+			for (int cpu = 0; cpu != CPU_SETSIZE; ++cpu)
+				CPU_SET(cpu, &gInheritedCPUs);
+		}
+		if (::sched_setaffinity(0, sizeof(cpus_), &cpus_) != 0) {
+			::fprintf(stderr, "warning: failed to pin to cpus: %s\n",
+			          ::strerror(errno));
+		} else {
+			gSchedPinned = true;
+		}
+	}
+
+	if (policy_ != SCHED_OTHER) {
+		struct sched_param param;
+		::memset(&param, 0, sizeof(param));
+		param.sched_priority = priority_;
+		if (::sched_setscheduler(0, policy_, &param) != 0) {
+			::fprintf(stderr,
+			    "warning: failed to enable %s scheduling with"
+			    " priority %i: %s%s\n",
+			    policy_ == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO",
+			    priority_, ::strerror(errno),
+			    errno == EPERM ?
+			    " (requires CAP_SYS_NICE or a high enough"
+			    " RLIMIT_RTPRIO)" : "");
+		} else {
+			gSchedRealtime = true;
+		}
+		// Wake up as exactly as possible for timeouts.
+		if (::prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) != 0) {
+			::fprintf(stderr,
+			          "warning: failed to reduce timer slack: %s\n",
+			          ::strerror(errno));
+		}
+	}
+
+	if (mlock_ && ::mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		::fprintf(stderr, "warning: failed to lock memory: %s%s\n",
+		          ::strerror(errno),
+		          (errno == EPERM || errno == ENOMEM) ?
+		          " (requires CAP_IPC_LOCK or a high enough"
+		          " RLIMIT_MEMLOCK)" : "");
+	}
+}
+
+// Memory locks are not inherited, but the scheduling policy, affinity and
+// timer slack survive both fork() and exec().
+void
+SchedOptions::resetChild() noexcept
+{
+	if (gSchedRealtime) {
+		struct sched_param param;
+		::memset(&param, 0, sizeof(param));
+		(void)::sched_setscheduler(0, SCHED_OTHER, &param);
+		(void)::prctl(PR_SET_TIMERSLACK, 0UL, 0UL, 0UL, 0UL);
+	}
+	if (gSchedPinned)
+		(void)::sched_setaffinity(0, sizeof(gInheritedCPUs),
+		                          &gInheritedCPUs);
+}
+
 static void
 usage_show [[noreturn]] (FILE *out, int exit_status)
 {
@@ -463,6 +581,18 @@ usage_create [[noreturn]] (FILE *out, int exit_status)
 "  --connect              try to connect before creating a new instance\n"
 "  --on-close=end|accept  whether to exit or restart on EOF\n"
 "  --daemonize            fork off into the background\n"
+"  --io-uring             batch device writes with stream reads via io_uring\n"
+"  --realtime[=POLICY[:PRIO]]\n"
+"                         use real-time scheduling (fifo or rr, default fifo:10)\n"
+"  --cpu=LIST             pin to the listed cpus, eg. 0,2-3\n"
+"  --mlock                lock all memory to avoid page faults\n"
+"  --device-cache=FILE    remember devices in FILE and pre-create them\n"
+"  --protocol=VERSION     highest protocol version to ask senders for\n"
+"  --reply-fd=FD          talk back to the sender via FD, eg. 1 over ssh\n"
+"  --latency-report=SECS  print event latency percentiles every SECS seconds\n"
+"  --tls-cert=FILE        certificate for --listen=tls:...\n"
+"  --tls-key=FILE         private key for --listen=tls:...\n"
+"  --tls-ca=FILE|DIR      CA to verify tls senders with\n"
 "duplicate device modes:\n"
 "  reject                 treat duplicates as errors and exit (default)\n"
 "  resume                 assume the devices are equivalent and resume them\n"
@@ -503,6 +633,429 @@ cat(int from, int to)
 	return 0;
 }
 
+#ifdef HAS_IO_URING
+// Submits the uinput writes of the previous packets together with the read
+// of the next one, so each packet costs at most a single system call.
+struct CreateRing {
+	CreateRing() : ring_(64) {}
+	CreateRing(const CreateRing&) = delete;
+
+	void write(OutDevice& dev, const InputEvent& ev);
+	// Same semantics as ::read(). Writes prepared until then get submitted
+	// along with the read, and are done once it returns.
+	ssize_t read(int fd, Span<uint8_t> buf);
+	// Submit and wait for all prepared writes. A single read brings many
+	// packets, so this is required before destroying a device whose events
+	// may still be waiting, or its fd could be reused for another one.
+	void flush();
+
+ private:
+	ssize_t complete(unsigned count);
+
+ private:
+	static const uint64_t kReadTag = ~uint64_t(0);
+	static const unsigned kMaxPending = 32;
+	URing ring_;
+	// the submitted frames have to stay around until they were written
+	struct input_event events_[256];
+	size_t used_ = 0;
+	unsigned pending_ = 0;
+};
+
+void
+CreateRing::write(OutDevice& dev, const InputEvent& ev)
+{
+	auto frame = dev.queue(ev);
+	if (frame.empty())
+		return;
+	size_t capacity = sizeof(events_)/sizeof(events_[0]);
+	if (pending_ == kMaxPending || capacity - used_ < frame.size())
+		flush();
+	auto copy = &events_[used_];
+	::memcpy(copy, frame.data(), frame.size() * sizeof(frame[0]));
+	used_ += frame.size();
+	ring_.write(dev.fd(), copy, frame.size() * sizeof(frame[0]), pending_);
+	++pending_;
+}
+
+ssize_t
+CreateRing::read(int fd, Span<uint8_t> buf)
+{
+	ring_.read(fd, buf.data(), buf.size(), kReadTag);
+	ssize_t got = complete(pending_ + 1);
+	pending_ = 0;
+	used_ = 0;
+	if (got < 0) {
+		errno = int(-got);
+		return -1;
+	}
+	return got;
+}
+
+void
+CreateRing::flush()
+{
+	if (pending_)
+		(void)complete(pending_);
+	pending_ = 0;
+	used_ = 0;
+}
+
+// Wait for `count` completions, returns the result of the read if there
+// was one.
+ssize_t
+CreateRing::complete(unsigned count)
+{
+	ssize_t result = 0;
+	struct io_uring_cqe cqe;
+	while (count) {
+		ring_.enter(count);
+		while (ring_.next(&cqe)) {
+			--count;
+			if (cqe.user_data == kReadTag) {
+				result = cqe.res;
+			} else if (cqe.res < 0) {
+				errno = -cqe.res;
+				throw ErrnoException("failed to write event");
+			}
+		}
+	}
+	return result;
+}
+#endif
+
+// The created devices, indexed directly by their id. Senders hand out ids
+// densely starting at 0, so this stays small, and looking up the device of an
+// event is a single indexed load. Empty slots have no device.
+struct DeviceTable {
+	OutDevice* get(uint16_t id) const noexcept {
+		return id < slots_.size() ? slots_[id].get() : nullptr;
+	}
+
+	void set(uint16_t id, uniq<OutDevice> dev) {
+		if (id >= slots_.size())
+			slots_.resize(size_t(id) + 1);
+		slots_[id] = std::move(dev);
+	}
+
+	uniq<OutDevice> remove(uint16_t id) {
+		if (id >= slots_.size())
+			return {};
+		return std::move(slots_[id]);
+	}
+
+	// Calls func(id, device) for every device.
+	template<typename Func>
+	void each(Func&& func) const {
+		for (size_t id = 0; id != slots_.size(); ++id) {
+			if (slots_[id])
+				func(uint16_t(id), *slots_[id]);
+		}
+	}
+
+ private:
+	std::vector<uniq<OutDevice>> slots_;
+};
+
+// Devices not announced by the current client, by fingerprint.
+using DevicePool = std::multimap<uint64_t, uniq<OutDevice>>;
+
+// The device cache is a netevent 2 stream consisting of the Hello packet
+// followed by the AddDevice packets of every device with a fingerprint.
+// It is assembled in memory here and written out by the DeviceCreator.
+static std::vector<uint8_t>
+serializeDeviceCache(const DeviceTable& devices, const DevicePool& pool)
+{
+	std::vector<uint8_t> data;
+	NE2Packet hello = makeHello();
+	auto bytes = reinterpret_cast<const uint8_t*>(&hello);
+	data.insert(data.end(), bytes, bytes + sizeof(hello));
+	devices.each([&data](uint16_t id, const OutDevice& dev) {
+		if (dev.fingerprint())
+			dev.appendNE2AddDevice(data, id);
+	});
+	for (const auto& dev : pool)
+		dev.second->appendNE2AddDevice(data, 0);
+	return data;
+}
+
+static void
+writeDeviceCache(const string& path, const std::vector<uint8_t>& data)
+{
+	string tmppath = path + ".tmp";
+	int fd = ::open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	                0600);
+	if (fd < 0)
+		throw ErrnoException("failed to create %s", tmppath.c_str());
+	IOHandle handle { fd };
+	if (!mustWrite(fd, data.data(), data.size()))
+		throw ErrnoException("failed to write %s", tmppath.c_str());
+	handle.close();
+	if (::rename(tmppath.c_str(), path.c_str()) != 0)
+		throw ErrnoException("failed to rename %s", tmppath.c_str());
+}
+
+static void
+loadDeviceCache(const char *path, DevicePool& pool)
+{
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		throw ErrnoException("failed to open %s", path);
+	}
+	IOHandle handle { fd };
+	readHello(fd);
+	NE2Packet pkt = {};
+	while (mustRead(fd, &pkt, sizeof(pkt))) {
+		pkt.cmd = be16toh(pkt.cmd);
+		if (pkt.cmd != uint16_t(NE2Command::AddDevice))
+			throw MsgException("unexpected packet type %u",
+			                   pkt.cmd);
+		pkt.add_device.dev_info_size =
+		    be16toh(pkt.add_device.dev_info_size);
+		pkt.add_device.dev_name_size =
+		    be16toh(pkt.add_device.dev_name_size);
+		uint64_t fingerprint = be64toh(pkt.add_device.fingerprint);
+		if (!fingerprint)
+			throw MsgException("device without fingerprint");
+		auto dev = OutDevice::newFromNE2AddCommand(fd, pkt);
+		dev->fingerprint(fingerprint);
+		pool.emplace(fingerprint, std::move(dev));
+	}
+	if (errno)
+		throw ErrnoException("read error");
+}
+
+// Creates the uinput devices on a separate thread, so the events of the
+// other devices keep flowing while the kernel sets up a new one. Events for a
+// device which is not ready yet are queued up and written by the worker once
+// the device exists. The worker also writes the device cache, only the latest
+// snapshot of which is kept, so a burst of changes results in a single write.
+struct DeviceCreator {
+	DeviceCreator() = default;
+	DeviceCreator(const DeviceCreator&) = delete;
+	~DeviceCreator();
+
+	void add(NE2Packet& pkt, uint16_t id, uint64_t fingerprint,
+	         Span<const uint8_t> descriptor);
+
+	bool pending(uint16_t id) const {
+		return jobs_.find(id) != jobs_.end();
+	}
+	// Returns false if the device is already done, it should then be
+	// taken over via take().
+	bool queue(uint16_t id, const InputEvent& ev);
+	// Waits for the device to be created.
+	uniq<OutDevice> take(uint16_t id);
+	// Moves all the finished devices over, returns whether there were any.
+	bool collect(DeviceTable& devices);
+	// Waits for all the devices.
+	bool finish(DeviceTable& devices);
+	// Replaces the device cache contents which are yet to be written. The
+	// last one is written before the destructor returns.
+	void saveCache(const char *path, std::vector<uint8_t> data);
+
+ private:
+	struct Job {
+		NE2Packet pkt = {};
+		std::vector<uint8_t> descriptor;
+		uint64_t fingerprint;
+		uniq<OutDevice> device;
+		std::vector<InputEvent> queue;
+		string error;
+		bool done = false;
+	};
+	void start();
+	void run();
+	void writeCache(std::unique_lock<std::mutex>& lock);
+
+ private:
+	// jobs_ is only used by the main thread, the jobs' contents are
+	// protected by mutex_
+	map<uint16_t, std::shared_ptr<Job>> jobs_;
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::condition_variable finished_;
+	std::deque<std::shared_ptr<Job>> todo_;
+	std::atomic<unsigned> done_ { 0 };
+	string cachePath_;
+	std::vector<uint8_t> cache_;
+	bool cacheDirty_ = false;
+	bool quit_ = false;
+	std::thread thread_;
+};
+
+DeviceCreator::~DeviceCreator()
+{
+	if (!thread_.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		quit_ = true;
+	}
+	wakeup_.notify_one();
+	thread_.join();
+}
+
+void
+DeviceCreator::add(NE2Packet& pkt, uint16_t id, uint64_t fingerprint,
+                   Span<const uint8_t> descriptor)
+{
+	if (pending(id))
+		throw Exception("internal error: device already pending");
+	auto job = std::make_shared<Job>();
+	job->pkt = pkt;
+	job->descriptor.assign(descriptor.begin(), descriptor.end());
+	job->fingerprint = fingerprint;
+	jobs_[id] = job;
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		todo_.emplace_back(std::move(job));
+	}
+	start();
+	wakeup_.notify_one();
+}
+
+void
+DeviceCreator::start()
+{
+	if (!thread_.joinable())
+		thread_ = std::thread([this]() { run(); });
+}
+
+void
+DeviceCreator::saveCache(const char *path, std::vector<uint8_t> data)
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		cachePath_ = path;
+		cache_ = std::move(data);
+		cacheDirty_ = true;
+	}
+	start();
+	wakeup_.notify_one();
+}
+
+void
+DeviceCreator::writeCache(std::unique_lock<std::mutex>& lock)
+{
+	string path = cachePath_;
+	std::vector<uint8_t> data = std::move(cache_);
+	cacheDirty_ = false;
+	lock.unlock();
+	try {
+		writeDeviceCache(path, data);
+	} catch (const Exception& ex) {
+		::fprintf(stderr, "failed to update device cache: %s\n",
+		          ex.what());
+	}
+	lock.lock();
+}
+
+bool
+DeviceCreator::queue(uint16_t id, const InputEvent& ev)
+{
+	auto& job = jobs_.at(id);
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (job->done)
+		return false;
+	job->queue.push_back(ev);
+	return true;
+}
+
+uniq<OutDevice>
+DeviceCreator::take(uint16_t id)
+{
+	auto iter = jobs_.find(id);
+	auto job = std::move(iter->second);
+	jobs_.erase(iter);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	finished_.wait(lock, [&]() { return job->done; });
+	--done_;
+	if (!job->error.empty())
+		throw MsgException("failed to create device %u: %s",
+		                   id, job->error.c_str());
+	return std::move(job->device);
+}
+
+bool
+DeviceCreator::collect(DeviceTable& devices)
+{
+	if (!done_.load(std::memory_order_relaxed))
+		return false;
+	std::vector<uint16_t> finished;
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		for (const auto& job : jobs_) {
+			if (job.second->done)
+				finished.push_back(job.first);
+		}
+	}
+	for (auto id : finished)
+		devices.set(id, take(id));
+	return !finished.empty();
+}
+
+bool
+DeviceCreator::finish(DeviceTable& devices)
+{
+	if (jobs_.empty())
+		return false;
+	while (!jobs_.empty()) {
+		auto id = jobs_.begin()->first;
+		devices.set(id, take(id));
+	}
+	return true;
+}
+
+void
+DeviceCreator::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		wakeup_.wait(lock, [&]() {
+			return quit_ || cacheDirty_ || !todo_.empty();
+		});
+		if (cacheDirty_) {
+			writeCache(lock);
+			continue;
+		}
+		if (quit_)
+			return;
+		auto job = std::move(todo_.front());
+		todo_.pop_front();
+
+		lock.unlock();
+		uniq<OutDevice> device;
+		string error;
+		try {
+			device = OutDevice::newFromNE2Descriptor(
+			    job->pkt, std::move(job->descriptor));
+			device->fingerprint(job->fingerprint);
+		} catch (const Exception& ex) {
+			error = ex.what();
+		}
+		lock.lock();
+
+		try {
+			if (device) {
+				for (const auto& ev : job->queue)
+					device->write(ev);
+			}
+		} catch (const Exception& ex) {
+			error = ex.what();
+		}
+		job->queue.clear();
+		job->device = std::move(device);
+		job->error = std::move(error);
+		job->done = true;
+		++done_;
+		finished_.notify_all();
+	}
+}
+
 static int
 cmd_create(int argc, char **argv)
 {
@@ -517,6 +1070,17 @@ cmd_create(int argc, char **argv)
 		{ "no-daemonize",   no_argument,       nullptr, 0xf003 },
 		{ "connect",        no_argument,       nullptr, 0x1004 },
 		{ "no-connect",     no_argument,       nullptr, 0xf004 },
+		{ "io-uring",       no_argument,       nullptr, 0x1005 },
+		{ "realtime",       optional_argument, nullptr, 0x1006 },
+		{ "cpu",            required_argument, nullptr, 0x1007 },
+		{ "mlock",          no_argument,       nullptr, 0x1008 },
+		{ "device-cache",   required_argument, nullptr, 0x1009 },
+		{ "protocol",       required_argument, nullptr, 0x100a },
+		{ "reply-fd",       required_argument, nullptr, 0x100b },
+		{ "latency-report", required_argument, nullptr, 0x100c },
+		{ "tls-cert",       required_argument, nullptr, 0x100d },
+		{ "tls-key",        required_argument, nullptr, 0x100e },
+		{ "tls-ca",         required_argument, nullptr, 0x100f },
 		{ nullptr, 0, nullptr, 0 }
 	};
 
@@ -524,12 +1088,21 @@ cmd_create(int argc, char **argv)
 	bool optLegacyMode = false;
 	bool optDaemonize = false;
 	bool optConnect = false;
+	bool optURing = false;
+	uint16_t optProtocol = kNE3Version;
+	int optReplyFD = -1;
+	unsigned long optLatencyReport = 0;
+	SchedOptions optSched;
 	enum class DuplicateMode { Reject, Resume, Replace }
 	optDuplicates = DuplicateMode::Reject;
 	enum class CloseAction { End, Accept }
 	optOnClose = CloseAction::Accept;
 
 	const char *optListen = nullptr;
+	const char *optDeviceCache = nullptr;
+	const char *optTLSCert = nullptr;
+	const char *optTLSKey = nullptr;
+	const char *optTLSCA = nullptr;
 
 	int c, optindex = 0;
 	opterr = 1;
@@ -548,6 +1121,64 @@ cmd_create(int argc, char **argv)
 		 case 0xf003: optDaemonize = false; break;
 		 case 0x1004: optConnect = true; break;
 		 case 0xf004: optConnect = false; break;
+		 case 0x1005:
+			no_legacy = true;
+#ifdef HAS_IO_URING
+			optURing = true;
+			break;
+#else
+			::fprintf(stderr,
+			    "netevent was built without io_uring support\n");
+			return 2;
+#endif
+		 case 0x1006: optSched.parseRealtime(optarg); break;
+		 case 0x1007: optSched.parseCPUs(optarg); break;
+		 case 0x1008: optSched.lockMemory(); break;
+		 case 0x1009:
+			no_legacy = true;
+			optDeviceCache = optarg;
+			break;
+		 case 0x100a:
+		 {
+			no_legacy = true;
+			unsigned long value;
+			if (!parseULong(&value, optarg, size_t(-1)) ||
+			    value < kNE2Version || value > kNE3Version)
+			{
+				::fprintf(stderr, "bad protocol version: %s\n",
+				          optarg);
+				usage_create(stderr, EXIT_FAILURE);
+			}
+			optProtocol = uint16_t(value);
+			break;
+		 }
+		 case 0x100b:
+		 {
+			no_legacy = true;
+			unsigned long value;
+			if (!parseULong(&value, optarg, size_t(-1)) ||
+			    value > 0xFFFF)
+			{
+				::fprintf(stderr, "bad file descriptor: %s\n",
+				          optarg);
+				usage_create(stderr, EXIT_FAILURE);
+			}
+			optReplyFD = int(value);
+			break;
+		 }
+		 case 0x100c:
+			no_legacy = true;
+			if (!parseULong(&optLatencyReport, optarg, size_t(-1)) ||
+			    !optLatencyReport)
+			{
+				::fprintf(stderr, "bad report interval: %s\n",
+				          optarg);
+				usage_create(stderr, EXIT_FAILURE);
+			}
+			break;
+		 case 0x100d: no_legacy = true; optTLSCert = optarg; break;
+		 case 0x100e: no_legacy = true; optTLSKey = optarg; break;
+		 case 0x100f: no_legacy = true; optTLSCA = optarg; break;
 		 case 'd':
 			no_legacy = true;
 			if (!::strcasecmp(optarg, "reject"))
@@ -608,19 +1239,69 @@ cmd_create(int argc, char **argv)
 	if (optLegacyMode) {
 		if (optDaemonize)
 			doDaemonize(optListen);
+		optSched.apply();
 		return cmd_create_legacy();
 	}
 
-	map<uint16_t, uniq<OutDevice>> devices;
+	DeviceTable devices;
+	DevicePool pool;
+	// The ids the current client has announced so far. Devices left over
+	// from previous clients are taken over by the new one if it announces
+	// an identical device, no matter which id it uses.
+	std::set<uint16_t> claimed;
+	DeviceCreator creator;
 
 	int infd = 0;
 	IOHandle outhandle;
 	Socket serversock;
 	IOHandle inhandle;
 
+	const char *optTCP = nullptr;
+	const char *optUDP = nullptr;
+	bool optTLS = false;
+	if (optListen && ::strncmp(optListen, "tcp:", 4) == 0)
+		optTCP = optListen + 4;
+	if (optListen && ::strncmp(optListen, "udp:", 4) == 0)
+		optUDP = optListen + 4;
+	if (optListen && ::strncmp(optListen, "tls:", 4) == 0) {
+		optTCP = optListen + 4;
+		optTLS = true;
+	}
+	if ((optUDP || optTLS) && optConnect) {
+		::fprintf(stderr, "--connect does not work with %s\n",
+		          optUDP ? "udp" : "tls");
+		return 2;
+	}
+	if (optTLS != (optTLSCert || optTLSKey || optTLSCA) ||
+	    (optTLS && !(optTLSCert && optTLSKey && optTLSCA)))
+	{
+		::fprintf(stderr, "--listen=tls:... requires --tls-cert,"
+		                  " --tls-key and --tls-ca\n");
+		return 2;
+	}
+#ifdef HAS_TLS
+	std::shared_ptr<TLSContext> tls;
+	if (optTLS) {
+		tls = std::make_shared<TLSContext>(true, optTLSCert, optTLSKey,
+		                                   optTLSCA);
+		// the relay thread writes to the network
+		::signal(SIGPIPE, SIG_IGN);
+	}
+#else
+	if (optTLS) {
+		::fprintf(stderr, "netevent was built without tls support\n");
+		return 2;
+	}
+#endif
+	// Datagram senders announce all devices again when asked to resync.
+	if (optUDP && optDuplicates == DuplicateMode::Reject)
+		optDuplicates = DuplicateMode::Resume;
+
 	if (optConnect) {
 		try {
-			if (optListen[0] == '@')
+			if (optTCP)
+				serversock.connectTCP(optTCP);
+			else if (optListen[0] == '@')
 				serversock.connectUnix<true>(optListen+1);
 			else
 				serversock.connectUnix<false>(optListen);
@@ -656,68 +1337,352 @@ cmd_create(int argc, char **argv)
 		p1.close();
 	}
 
-	if (optListen) {
-		if (optListen[0] == '@')
+	if (optUDP) {
+		serversock.bindUDP(optUDP);
+		inhandle = serversock.release();
+		infd = inhandle.fd();
+	} else if (optListen) {
+		if (optTCP)
+			serversock.listenTCP(optTCP);
+		else if (optListen[0] == '@')
 			serversock.listenUnix<true>(optListen+1);
 		else
 			serversock.listenUnix<false>(optListen);
 	}
+	auto acceptClient = [&]() {
+		while (true) {
+			inhandle = serversock.accept();
+			infd = inhandle.fd();
+			if (optTCP)
+				Socket::tuneTCP(infd);
+#ifdef HAS_TLS
+			if (!tls)
+				return;
+			// Senders which fail to authenticate are not fatal.
+			try {
+				inhandle = tls->accept(std::move(inhandle));
+			} catch (const Exception& ex) {
+				::fprintf(stderr, "%s\n", ex.what());
+				continue;
+			}
+			infd = inhandle.fd();
+#endif
+			return;
+		}
+	};
 
 	if (optDaemonize)
 		doDaemonize(optListen);
+	// after forking, memory locks are not inherited
+	optSched.apply();
 
-	if (optListen) {
-		if (!inhandle) {
-			inhandle = serversock.accept();
-			infd = inhandle.fd();
+	if (optDeviceCache) {
+		try {
+			loadDeviceCache(optDeviceCache, pool);
+		} catch (const Exception& ex) {
+			::fprintf(stderr, "failed to load device cache: %s\n",
+			          ex.what());
 		}
+	}
+	auto updateDeviceCache = [&]() {
+		if (!optDeviceCache)
+			return;
+		creator.saveCache(optDeviceCache,
+		                  serializeDeviceCache(devices, pool));
+	};
+
+	if (optListen && !optUDP) {
+		if (!inhandle)
+			acceptClient();
 		if (optOnClose == CloseAction::End)
 			serversock.close();
 	}
 
-	readHello(infd);
+#ifdef HAS_IO_URING
+	uniq<CreateRing> ring;
+	if (optURing)
+		ring.reset(new CreateRing);
+#else
+	(void)optURing;
+#endif
+
+	uniq<LatencyReport> latency;
+	if (optLatencyReport)
+		latency.reset(new LatencyReport(optLatencyReport));
+
+	NE2Decoder decoder;
+
+	// UDP: every datagram holds whole packets behind a NE2DatagramHeader.
+	// The sender is whoever sent the last accepted datagram. Gaps in the
+	// sequence numbers make us ask the sender for a resync.
+	struct sockaddr_storage peer;
+	socklen_t peerlen = 0;
+	uint32_t expectedSeq = 0;
+	uint64_t resyncedAt = 0;
+	auto requestResync = [&]() {
+		uint64_t now = nowNS(CLOCK_MONOTONIC);
+		if (now - resyncedAt < 100000000ULL)
+			return;
+		resyncedAt = now;
+		NE2Packet pkt = {};
+		pkt.cmd = htobe16(uint16_t(NE2Command::Resync));
+		if (::sendto(infd, &pkt, sizeof(pkt), 0,
+		             reinterpret_cast<struct sockaddr*>(&peer),
+		             peerlen) != sizeof(pkt))
+			::fprintf(stderr, "failed to request a resync: %s\n",
+			          ::strerror(errno));
+	};
+	auto receiveDatagram = [&]() -> ssize_t {
+		while (true) {
+			decoder.reset();
+			NE2DatagramHeader header;
+			auto space = decoder.space();
+			struct iovec iov[2] = {
+				{ &header, sizeof(header) },
+				{ space.data(), space.size() },
+			};
+			struct sockaddr_storage from;
+			struct msghdr msg;
+			::memset(&msg, 0, sizeof(msg));
+			msg.msg_name = &from;
+			msg.msg_namelen = sizeof(from);
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+			ssize_t got = ::recvmsg(infd, &msg, 0);
+			if (got < 0) {
+				if (errno == EINTR)
+					continue;
+				return got;
+			}
+			if (size_t(got) < sizeof(header) ||
+			    ::memcmp(header.magic, kNE2DatagramMagic,
+			             sizeof(header.magic)) != 0)
+				continue;
+			uint32_t seq = be32toh(header.seq);
+			if (msg.msg_namelen != peerlen ||
+			    ::memcmp(&from, &peer, peerlen) != 0)
+			{
+				// A new sender, or the old one restarted. If
+				// we missed its start, we need a resync.
+				::memcpy(&peer, &from, msg.msg_namelen);
+				peerlen = msg.msg_namelen;
+				claimed.clear();
+				resyncedAt = 0;
+				expectedSeq = 0;
+			}
+			int32_t gap = int32_t(seq - expectedSeq);
+			if (gap < 0)
+				continue; // reordered or duplicated
+			expectedSeq = seq + 1;
+			if (gap > 0)
+				requestResync();
+			decoder.version(be16toh(header.version));
+			decoder.filled(size_t(got) - sizeof(header));
+			return got;
+		}
+	};
+
+	// Same semantics as mustRead(), but with as many packets as are
+	// available getting buffered.
+	auto readPacket = [&](NE2Packet *pkt, Span<const uint8_t> *desc) {
+		while (!decoder.next(pkt, desc)) {
+			ssize_t got;
+			if (optUDP)
+				got = receiveDatagram();
+			else
+#ifdef HAS_IO_URING
+			if (ring) {
+				auto space = decoder.space();
+				got = ring->read(infd, space);
+				if (got > 0)
+					decoder.filled(size_t(got));
+			} else
+#endif
+				got = decoder.fill(infd);
+			if (got == 0)
+				errno = 0;
+			if (got <= 0)
+				return false;
+			if (optTCP && !optTLS)
+				Socket::quickAck(infd);
+		}
+		return true;
+	};
+
+	// Sockets allow us to talk back to the sender, otherwise only
+	// --reply-fd does.
+	auto replyFD = [&]() {
+		struct stat st;
+		if (optReplyFD >= 0)
+			return optReplyFD;
+		if (::fstat(infd, &st) == 0 && S_ISSOCK(st.st_mode))
+			return infd;
+		return -1;
+	};
+	// Before a device may be destroyed.
+	auto finishWrites = [&]() {
+#ifdef HAS_IO_URING
+		if (ring)
+			ring->flush();
+#endif
+	};
+
+	auto reply = [&](const NE2Packet& pkt, const char *what) {
+		if (optUDP) {
+			if (::sendto(infd, &pkt, sizeof(pkt), 0,
+			             reinterpret_cast<struct sockaddr*>(&peer),
+			             peerlen) != sizeof(pkt))
+				::fprintf(stderr,
+				          "failed to answer %s packet: %s\n",
+				          what, ::strerror(errno));
+			return;
+		}
+		int fd = replyFD();
+		if (fd >= 0 && !mustWrite(fd, &pkt, sizeof(pkt)))
+			::fprintf(stderr, "failed to answer %s packet: %s\n",
+			          what, ::strerror(errno));
+	};
+
+	// Answering the sender's Hello packet switches to a newer protocol
+	// version or enables optional features. Only Hello packets offering
+	// more than they use get answered, the one switching the stream over
+	// does not.
+	auto handleHello = [&](NE2Packet& pkt) {
+		checkHello(pkt);
+		uint16_t version = std::min(pkt.hello.max_version, optProtocol);
+		uint16_t features = pkt.hello.features & kNE2Features;
+		if (pkt.hello.version == kNE2Version &&
+		    pkt.hello.max_version > pkt.hello.version &&
+		    (version > kNE2Version || features))
+		{
+			reply(makeHello(version, version, features), "hello");
+		}
+		decoder.version(pkt.hello.version);
+	};
+
 	NE2Packet pkt = {};
+	Span<const uint8_t> descriptor;
+	// Datagrams carry the version in their header, and the Hello packet
+	// may well be lost.
+	if (!optUDP) {
+		if (!readPacket(&pkt, &descriptor))
+			throw ErrnoException(
+			    "error while expecting hello packet");
+		pkt.cmd = be16toh(pkt.cmd);
+		handleHello(pkt);
+	}
  Resume:
-	while (mustRead(infd, &pkt, sizeof(pkt))) {
+	while (readPacket(&pkt, &descriptor)) {
+		if (creator.collect(devices))
+			updateDeviceCache();
+		if (latency)
+			latency->tick();
 		pkt.cmd = be16toh(pkt.cmd);
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wcovered-switch-default"
 		switch (static_cast<NE2Command>(pkt.cmd)) {
 		 case NE2Command::Hello:
-			checkHello(pkt);
+			handleHello(pkt);
 			break;
 		 case NE2Command::KeepAlive:
+		 {
+			uint16_t flags = be16toh(pkt.keepalive.flags);
+			if ((flags & kKeepAliveOffset) && latency)
+				latency->offset(int64_t(
+				    be64toh(pkt.keepalive.clock)));
+			if (flags & kKeepAliveEcho) {
+				pkt.cmd = htobe16(pkt.cmd);
+				pkt.keepalive.flags = htobe16(kKeepAliveReply);
+				pkt.keepalive.clock =
+				    htobe64(nowNS(CLOCK_REALTIME));
+				reply(pkt, "keepalive");
+			}
 			break;
+		 }
 		 case NE2Command::AddDevice:
 		 {
+			// it may replace a device
+			finishWrites();
 			pkt.add_device.id = be16toh(pkt.add_device.id);
 			pkt.add_device.dev_info_size =
 			    be16toh(pkt.add_device.dev_info_size);
 			pkt.add_device.dev_name_size =
 			    be16toh(pkt.add_device.dev_name_size);
-
-			if (optDuplicates == DuplicateMode::Replace) {
-				auto dev =
-				    OutDevice::newFromNE2AddCommand(infd, pkt);
-				devices[pkt.add_device.id] = std::move(dev);
-				break;
+			uint64_t fingerprint =
+			    be64toh(pkt.add_device.fingerprint);
+
+			uint16_t id = pkt.add_device.id;
+			if (creator.pending(id))
+				devices.set(id, creator.take(id));
+			OutDevice *old = devices.get(id);
+			if (fingerprint && !claimed.count(id)) {
+				// Take over an identical device from the warm pool
+				// or from a previous client.
+				bool same = old &&
+				            old->fingerprint() == fingerprint;
+				uniq<OutDevice> warm;
+				auto pooled = pool.find(fingerprint);
+				if (!same && pooled != pool.end()) {
+					warm = std::move(pooled->second);
+					pool.erase(pooled);
+				} else if (!same) {
+					int other = -1;
+					devices.each([&](uint16_t i,
+					                 const OutDevice& dev) {
+						if (other < 0 &&
+						    !claimed.count(i) &&
+						    dev.fingerprint() ==
+						    fingerprint)
+							other = i;
+					});
+					if (other >= 0)
+						warm = devices.remove(
+						    uint16_t(other));
+				}
+				if (same || warm) {
+					claimed.insert(id);
+					if (!warm)
+						break;
+					// The unclaimed device previously using
+					// this id stays around for later clients.
+					if (old && old->fingerprint())
+						pool.emplace(old->fingerprint(),
+						             devices.remove(id));
+					devices.set(id, std::move(warm));
+					updateDeviceCache();
+					break;
+				}
 			}
+			claimed.insert(id);
 
-			auto old = devices.find(pkt.add_device.id);
-			if (old == devices.end()) {
-				auto dev =
-				    OutDevice::newFromNE2AddCommand(infd, pkt);
-				devices[pkt.add_device.id] = std::move(dev);
+			if (!old) {
+				creator.add(pkt, id, fingerprint, descriptor);
 				break;
 			}
 
 			if (optDuplicates == DuplicateMode::Reject)
 				throw MsgException(
-				    "protocol error: duplicate device %u",
-				    pkt.add_device.id);
+				    "protocol error: duplicate device %u", id);
+
+			// Without fingerprints (0) we cannot tell whether it
+			// is the same device.
+			bool known = fingerprint &&
+			             old->fingerprint() == fingerprint;
+			bool changed = fingerprint &&
+			               old->fingerprint() &&
+			               old->fingerprint() != fingerprint;
+
+			// Keep identical devices instead of making the system
+			// go through the removal and re-creation.
+			if (known ||
+			    (optDuplicates == DuplicateMode::Resume && !changed))
+				break;
 
-			if (optDuplicates == DuplicateMode::Resume) {
-				OutDevice::skipNE2AddCommand(infd, pkt);
+			if (optDuplicates == DuplicateMode::Replace ||
+			    optDuplicates == DuplicateMode::Resume)
+			{
+				(void)devices.remove(id);
+				creator.add(pkt, id, fingerprint, descriptor);
 				break;
 			}
 
@@ -725,23 +1690,44 @@ cmd_create(int argc, char **argv)
 		 }
 		 case NE2Command::RemoveDevice:
 		 {
+			finishWrites();
 			auto id = be16toh(pkt.remove_device.id);
-			auto iter = devices.find(id);
-			if (iter == devices.end())
+			if (creator.pending(id))
+				devices.set(id, creator.take(id));
+			if (!devices.remove(id) && !optUDP)
 				throw MsgException(
 				    "protocol error: missing device %u", id);
-			devices.erase(iter);
+			claimed.erase(id);
+			updateDeviceCache();
 			break;
 		 }
 		 case NE2Command::DeviceEvent:
 		 {
 			auto id = be16toh(pkt.event.id);
-		 	auto iter = devices.find(id);
-			if (iter == devices.end())
-				throw MsgException(
-				    "protocol error: missing device %u", id);
 		 	pkt.event.event.toHost();
-		 	iter->second->write(pkt.event.event);
+		 	OutDevice *dev = devices.get(id);
+			if (!dev) {
+				// over UDP the AddDevice packet may be lost,
+				// the resync brings it
+				if (!creator.pending(id) && optUDP)
+					break;
+				if (!creator.pending(id))
+					throw MsgException(
+					    "protocol error: missing device %u",
+					    id);
+				if (creator.queue(id, pkt.event.event))
+					break;
+				devices.set(id, creator.take(id));
+				dev = devices.get(id);
+			}
+#ifdef HAS_IO_URING
+			if (ring)
+				ring->write(*dev, pkt.event.event);
+			else
+#endif
+				dev->write(pkt.event.event);
+			if (latency)
+				latency->record(pkt.event.event);
 			break;
 		 }
 		 default:
@@ -753,12 +1739,17 @@ cmd_create(int argc, char **argv)
 	}
 	if (errno)
 		throw ErrnoException("read error");
+	if (creator.finish(devices))
+		updateDeviceCache();
+	if (latency)
+		latency->tick(true);
 	// Otherwise we are at EOF, if we're in listen mode, accept another
 	// client.
 	if (serversock) {
 		inhandle.close();
-		inhandle = serversock.accept();
-		infd = inhandle.fd();
+		acceptClient();
+		claimed.clear();
+		decoder.reset();
 		goto Resume;
 	}
 	return 0;
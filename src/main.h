@@ -14,6 +14,7 @@
 #include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wreserved-id-macro"
 #pragma clang diagnostic ignored "-Wdocumentation-unknown-command"
@@ -30,6 +31,7 @@
 #include <exception>
 #include <memory>
 #include <functional>
+#include <vector>
 
 #include "config.h"
 #include "types.h"
@@ -88,6 +90,15 @@ struct InputEvent {
 static const char kNE2Hello[8] = { 'N', 'E', '2', 'H',
                                    'e', 'l', 'l', 'o', };
 static const uint16_t kNE2Version = 2;
+// Streams always start out with version 2. If the Hello packet's max_version
+// allows it, a receiver which can talk back answers with a Hello packet
+// carrying the version it wants, and the sender switches to it by sending
+// another Hello packet with that version. See ne3.h.
+static const uint16_t kNE3Version = 3;
+// Optional additions to version 2 streams, negotiated the same way via the
+// Hello packet's features.
+static const uint16_t kNE2FeatureFrames = 0x0001; // DeviceFrame packets
+static const uint16_t kNE2Features = kNE2FeatureFrames;
 
 enum class NE2Command : uint16_t {
 	KeepAlive    = 0,
@@ -95,10 +106,41 @@ enum class NE2Command : uint16_t {
 	RemoveDevice = 2,
 	DeviceEvent  = 3,
 	Hello        = 4,
+	DeviceFrame  = 5,
+	// from receivers which lost data, asking for all devices and their
+	// current state
+	Resync       = 6,
 };
 
+// A DeviceFrame packet is followed by `count` of these, all events share the
+// packet's timestamp.
+struct NE2FrameEvent {
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+} Packed;
+
+// KeepAlive packet flags. Receivers able to talk back echo the packets
+// asking for it, the sender uses them to measure the round trip time and
+// the offset between the clocks, which it passes back to the receiver.
+static const uint16_t kKeepAliveEcho   = 0x0001;
+static const uint16_t kKeepAliveReply  = 0x0002;
+static const uint16_t kKeepAliveOffset = 0x0004;
+
 struct NE2Packet {
 	// -Wnested-anon-types
+	struct KeepAlive {
+		uint16_t cmd;
+		uint16_t flags;
+		uint32_t seq;
+		// the sender's CLOCK_MONOTONIC in nanoseconds, echoed back
+		// unchanged
+		uint64_t time;
+		// With kKeepAliveOffset: the sender's CLOCK_REALTIME minus the
+		// receiver's in nanoseconds. In replies: the receiver's
+		// CLOCK_REALTIME.
+		uint64_t clock;
+	} Packed;
 	struct Event {
 		uint16_t cmd;
 		uint16_t id;
@@ -109,6 +151,9 @@ struct NE2Packet {
 		uint16_t id;
 		uint16_t dev_info_size;
 		uint16_t dev_name_size;
+		// Hash of the descriptor without the current axis values,
+		// 0 if the sender does not support it.
+		uint64_t fingerprint;
 	} Packed;
 	struct RemoveDevice {
 		uint16_t cmd;
@@ -118,18 +163,66 @@ struct NE2Packet {
 		uint16_t cmd;
 		uint16_t version;
 		char magic[8];
+		// highest version the sender supports, 0 for old senders
+		uint16_t max_version;
+		// kNE2Feature* flags offered by the sender, or in use after
+		// switching
+		uint16_t features;
+	} Packed;
+	struct DeviceFrame {
+		uint16_t cmd;
+		uint16_t id;
+		uint16_t count;
+		uint16_t reserved;
+		uint64_t tv_sec;
+		uint32_t tv_usec;
+		uint32_t padding;
 	} Packed;
 	union {
 		uint16_t cmd;
+		KeepAlive keepalive;
 		Event event;
 		AddDevice add_device;
 		RemoveDevice remove_device;
 		Hello hello;
+		DeviceFrame frame;
 	} Packed;
 };
 
+// Over UDP every datagram starts with this header, followed by complete
+// packets (or version 3 records) of the given protocol version. Receivers
+// use the sequence number to notice lost datagrams and ask for a Resync.
+static const char kNE2DatagramMagic[4] = { 'N', 'E', '2', 'D' };
+struct NE2DatagramHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t seq;
+} Packed;
+
+NE2Packet makeHello(uint16_t version = kNE2Version,
+                    uint16_t max_version = kNE3Version,
+                    uint16_t features = 0);
 void writeHello(int fd);
 
+// --realtime, --cpu and --mlock, shared by create and daemon
+struct SchedOptions {
+	void parseRealtime(const char *arg);
+	void parseCPUs(const char *arg);
+	void lockMemory() noexcept { mlock_ = true; }
+	// Failures due to missing privileges only produce warnings.
+	void apply() const;
+	// Undo apply() in a forked child before it executes another program.
+	static void resetChild() noexcept;
+
+ private:
+	int policy_ = SCHED_OTHER;
+	int priority_ = 0;
+	cpu_set_t cpus_;
+	bool pinned_ = false;
+	bool mlock_ = false;
+};
+
 unsigned int String2EV(const char* name, size_t length);
 
 #pragma clang diagnostic push
@@ -155,15 +248,41 @@ struct OutDevice {
 	static uniq<OutDevice> newFromNeteventStream(int fd);
 	static uniq<OutDevice> newFromNE2AddCommand(int fd, NE2Packet&);
 	static void skipNE2AddCommand(int fd, NE2Packet&);
+	// The size of the descriptor following an AddDevice packet (in host
+	// byte order) at the start of data, or 0 if it is incomplete.
+	static size_t ne2DescriptorSize(NE2Packet&, Span<const uint8_t> data);
+	static uniq<OutDevice> newFromNE2Descriptor(NE2Packet&,
+	                                            std::vector<uint8_t>);
+	// Append the AddDevice packet this device was created from.
+	void appendNE2AddDevice(std::vector<uint8_t>& out, uint16_t id) const;
 
 	int fd() const noexcept {
 		return fd_;
 	}
 
-	void write(const InputEvent& ev);
+	// fingerprint of the AddDevice descriptor it was created from
+	uint64_t fingerprint() const noexcept {
+		return fingerprint_;
+	}
+	void fingerprint(uint64_t value) noexcept {
+		fingerprint_ = value;
+	}
 
+	// Events are collected until the end of the frame (SYN_REPORT) and then
+	// written to uinput with a single write() call.
+	void write(const InputEvent& ev);
+	// Add the event to the current frame. Once the frame is complete it
+	// is returned for the caller to write, it stays valid until the next
+	// call.
+	Span<const struct input_event> queue(const InputEvent& ev);
  private:
-	static uniq<OutDevice> newFromNE2AddCommand(int, NE2Packet&, bool);
+	// Returns false for events we do not pass on to uinput.
+	static bool convertEvent(struct input_event *out,
+	                         const InputEvent& ev);
+	using ReadFn = function<bool(void*, size_t)>;
+	static uniq<OutDevice> newFromNE2AddCommand(NE2Packet&, const ReadFn&,
+	                                            bool skip,
+	                                            std::vector<uint8_t>& desc);
 	void assertNotCreated(const char *errmsg) const;
 
 	template<typename T>
@@ -173,9 +292,16 @@ struct OutDevice {
 	int fd_;
 	struct uinput_user_dev user_dev_;
 	bool created_ = false;
+	uint64_t fingerprint_ = 0;
+	std::vector<uint8_t> ne2Descriptor_;
+	static constexpr size_t kMaxFrameLength = 64;
+	struct input_event frame_[kMaxFrameLength];
+	size_t frameLength_ = 0;
 };
 
 struct InDevice {
+	static constexpr size_t kReadBatchSize = 64;
+
 	InDevice() = delete;
 	InDevice(InDevice&&);
 	InDevice(const InDevice&) = delete;
@@ -184,6 +310,13 @@ struct InDevice {
 
 	void writeNeteventHeader(int fd);
 	void writeNE2AddDevice(int fd, uint16_t id);
+	void buildNE2AddDevice(std::vector<uint8_t>& buf, uint16_t id);
+	// The AddDevice packet consists of this header followed by the
+	// device descriptor, which is only queried from the device once and
+	// then kept up to date by setName().
+	NE2Packet ne2AddDeviceHeader(uint16_t id) const;
+	const std::vector<uint8_t>& ne2Descriptor();
+	void updateNE2Descriptor();
 
 	void setName(const string&);
 	void resetName(); // Set to original name (remembered in name_)
@@ -199,6 +332,17 @@ struct InDevice {
 	}
 
 	bool read(InputEvent *out);
+	// Read all currently pending events (up to kReadBatchSize) with a
+	// single read() call. The returned span stays valid until the next
+	// call.
+	Span<const InputEvent> readBatch();
+	// For reading via other means (io_uring): the buffer readBatch()
+	// uses, and the conversion of `bytes` bytes read into it.
+	Span<uint8_t> rawBuffer() noexcept;
+	Span<const InputEvent> convertBatch(size_t bytes);
+	// Events bringing a copy of the device up to date: the state of every
+	// key and the value of every absolute axis.
+	void currentState(std::vector<InputEvent>& out);
 	bool eof() const noexcept {
 		return eof_;
 	}
@@ -227,6 +371,11 @@ struct InDevice {
 	struct uinput_user_dev user_dev_;
 	string name_;
 	Bits evbits_;
+	std::vector<struct input_event> rawbuf_;
+	std::vector<InputEvent> events_;
+	std::vector<uint8_t> ne2Descriptor_;
+	// hash of the descriptor after the name, see ne2AddDeviceHeader()
+	uint64_t ne2DescriptorHash_ = 0;
 };
 
 inline void
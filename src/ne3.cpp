@@ -0,0 +1,127 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "ne3.h"
+
+static inline void
+putVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back(uint8_t(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(uint8_t(value));
+}
+
+static inline uint64_t
+zigzag(int64_t value)
+{
+	return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t value)
+{
+	return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+static inline uint64_t
+timestamp(const InputEvent& ev)
+{
+	return ev.tv_sec * 1000000ULL + ev.tv_usec;
+}
+
+// Way more than any device produces for a single frame.
+static const uint64_t kMaxFrameEvents = 4096;
+
+void
+encodeNE3Frame(std::vector<uint8_t>& out, uint16_t id,
+               Span<const InputEvent> events)
+{
+	size_t at = 0;
+	while (at != events.size()) {
+		size_t count = events.size() - at;
+		if (count > kMaxFrameEvents)
+			count = kMaxFrameEvents;
+		out.push_back(kNE3Frame);
+		putVarint(out, id);
+		putVarint(out, count);
+		putVarint(out, events[at].tv_sec);
+		putVarint(out, events[at].tv_usec);
+		uint64_t last = timestamp(events[at]);
+		for (size_t end = at + count; at != end; ++at) {
+			const auto& ev = events[at];
+			uint64_t now = timestamp(ev);
+			putVarint(out, zigzag(int64_t(now - last)));
+			putVarint(out, ev.type);
+			putVarint(out, ev.code);
+			putVarint(out, zigzag(ev.value));
+			last = now;
+		}
+	}
+}
+
+namespace {
+struct VarintReader {
+	Span<const uint8_t> data;
+	size_t pos;
+
+	// Returns false if the data ends first.
+	bool get(uint64_t *out) {
+		uint64_t value = 0;
+		for (unsigned shift = 0; pos != data.size(); shift += 7) {
+			uint8_t byte = data[pos++];
+			if (shift > 63)
+				throw Exception("protocol error: bad varint");
+			value |= uint64_t(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				*out = value;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+}
+
+size_t
+decodeNE3Frame(Span<const uint8_t> data, uint16_t *id,
+               std::vector<InputEvent>& events)
+{
+	VarintReader reader { data, 1 };
+	uint64_t devid, count, sec, usec;
+	if (!reader.get(&devid) || !reader.get(&count) ||
+	    !reader.get(&sec) || !reader.get(&usec))
+	{
+		return 0;
+	}
+	if (devid > 0xffff)
+		throw Exception("protocol error: bad device id in frame");
+	if (count > kMaxFrameEvents)
+		throw Exception("protocol error: bad frame size");
+
+	events.clear();
+	uint64_t now = sec * 1000000ULL + usec;
+	for (uint64_t i = 0; i != count; ++i) {
+		uint64_t delta, type, code, value;
+		if (!reader.get(&delta) || !reader.get(&type) ||
+		    !reader.get(&code) || !reader.get(&value))
+		{
+			return 0;
+		}
+		now += uint64_t(unzigzag(delta));
+		InputEvent ev;
+		ev.tv_sec = now / 1000000ULL;
+		ev.tv_usec = uint32_t(now % 1000000ULL);
+		ev.type = uint16_t(type);
+		ev.code = uint16_t(code);
+		ev.value = int32_t(unzigzag(value));
+		events.push_back(ev);
+	}
+	*id = uint16_t(devid);
+	return reader.pos;
+}
@@ -0,0 +1,37 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include <vector>
+
+#include "main.h"
+
+// Protocol version 3 keeps the packets of version 2 for everything but
+// events, each prefixed by a record tag. Events are sent as frames:
+//
+//   kNE3Frame, id, count, tv_sec, tv_usec,
+//   count * (time delta in usec, type, code, value)
+//
+// with all numbers as LEB128 varints, the time delta (to the previous
+// event) and the value zigzag encoded. A typical mouse frame takes 3 to 4
+// bytes per event instead of the 24 of a version 2 packet.
+
+enum NE3Record : uint8_t {
+	kNE3Packet = 0, // followed by an NE2Packet (and AddDevice descriptor)
+	kNE3Frame  = 1,
+};
+
+// Append the events of a device as a single frame record.
+void encodeNE3Frame(std::vector<uint8_t>& out, uint16_t id,
+                    Span<const InputEvent> events);
+
+// Decode a frame record (including the tag) into events in host byte order.
+// Returns the size of the record, or 0 if it is incomplete, in which case
+// `events` may hold part of the frame.
+size_t decodeNE3Frame(Span<const uint8_t> data, uint16_t *id,
+                      std::vector<InputEvent>& events);
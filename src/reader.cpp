@@ -9,6 +9,8 @@
 
 #include "main.h"
 
+using std::vector;
+
 InDevice::InDevice(InDevice&& o)
 	: fd_(o.fd_)
 	, eof_(o.eof_)
@@ -16,6 +18,10 @@ InDevice::InDevice(InDevice&& o)
 	, user_dev_(o.user_dev_)
 	, name_(std::move(o.name_))
 	, evbits_(std::move(o.evbits_))
+	, rawbuf_(std::move(o.rawbuf_))
+	, events_(std::move(o.events_))
+	, ne2Descriptor_(std::move(o.ne2Descriptor_))
+	, ne2DescriptorHash_(o.ne2DescriptorHash_)
 {
 	o.fd_ = -1;
 }
@@ -41,6 +47,8 @@ InDevice::ctl(unsigned long req, T&& data, const char *errmsg, ...) const
 
 InDevice::InDevice(const string& path)
 	: evbits_(EV_MAX)
+	, rawbuf_(kReadBatchSize)
+	, events_(kReadBatchSize)
 {
 	::memset(&user_dev_, 0, sizeof(user_dev_));
 
@@ -87,18 +95,9 @@ InDevice::grab(bool on)
 	       : "failed to release input device");
 }
 
-bool
-InDevice::read(InputEvent *out)
+static inline void
+toInputEvent(InputEvent *out, const struct input_event& ev)
 {
-	struct input_event ev;
-	if (!mustRead(fd_, &ev, sizeof(ev))) {
-		if (!errno) {
-			eof_ = true;
-			throw Exception("unexpected EOF");
-		}
-		throw ErrnoException("failed to read from device");
-	}
-
 #ifdef input_event_sec
 	out->tv_sec = uint64_t(ev.input_event_sec);
 	out->tv_usec = uint32_t(ev.input_event_usec);
@@ -110,9 +109,59 @@ InDevice::read(InputEvent *out)
 	out->type = ev.type;
 	out->code = ev.code;
 	out->value = ev.value;
+}
+
+bool
+InDevice::read(InputEvent *out)
+{
+	struct input_event ev;
+	if (!mustRead(fd_, &ev, sizeof(ev))) {
+		if (!errno) {
+			eof_ = true;
+			throw Exception("unexpected EOF");
+		}
+		throw ErrnoException("failed to read from device");
+	}
+
+	toInputEvent(out, ev);
 	return !eof_;
 }
 
+Span<const InputEvent>
+InDevice::readBatch()
+{
+	// evdev only ever hands out whole events and returns as many as fit
+	// into the buffer, so one read() drains the whole queue.
+	auto got = ::read(fd_, rawbuf_.data(),
+	                  rawbuf_.size() * sizeof(rawbuf_[0]));
+	if (got == 0) {
+		eof_ = true;
+		throw Exception("unexpected EOF");
+	}
+	if (got < 0)
+		throw ErrnoException("failed to read from device");
+	return convertBatch(size_t(got));
+}
+
+Span<uint8_t>
+InDevice::rawBuffer() noexcept
+{
+	return { reinterpret_cast<uint8_t*>(rawbuf_.data()),
+	         rawbuf_.size() * sizeof(rawbuf_[0]) };
+}
+
+Span<const InputEvent>
+InDevice::convertBatch(size_t bytes)
+{
+	if (bytes % sizeof(rawbuf_[0]) != 0)
+		throw Exception("short read from device");
+
+	size_t count = bytes / sizeof(rawbuf_[0]);
+	for (size_t i = 0; i != count; ++i)
+		toInputEvent(&events_[i], rawbuf_[i]);
+	return { events_.data(), count };
+}
+
 void
 InDevice::setName(const string& name)
 {
@@ -123,6 +172,11 @@ InDevice::setName(const string& name)
 	::memcpy(user_dev_.name, name.c_str(), name.length());
 	::memset(&user_dev_.name[name.length()], 0,
 	         sizeof(user_dev_.name) - name.length());
+	// the descriptor starts with the name
+	if (!ne2Descriptor_.empty()) {
+		::memcpy(ne2Descriptor_.data(), user_dev_.name,
+		         sizeof(user_dev_.name));
+	}
 }
 
 void
@@ -221,8 +275,32 @@ InDevice::writeNeteventHeader(int fd)
 void
 InDevice::writeNE2AddDevice(int fd, uint16_t id)
 {
-	struct iovec iov[5];
+	vector<uint8_t> buf;
+	buildNE2AddDevice(buf, id);
+	if (!mustWrite(fd, buf.data(), buf.size()))
+		throw ErrnoException("failed to write device header");
+}
+
+static inline void
+append(vector<uint8_t>& buf, const void *data, size_t size)
+{
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+	buf.insert(buf.end(), bytes, bytes + size);
+}
+
+void
+InDevice::buildNE2AddDevice(vector<uint8_t>& buf, uint16_t id)
+{
+	const auto& desc = ne2Descriptor();
+	NE2Packet pkt = ne2AddDeviceHeader(id);
+	append(buf, &pkt, sizeof(pkt));
+	buf.insert(buf.end(), desc.begin(), desc.end());
+}
 
+// Call ne2Descriptor() first.
+NE2Packet
+InDevice::ne2AddDeviceHeader(uint16_t id) const
+{
 	NE2Packet pkt = {};
 	::memset(reinterpret_cast<void*>(&pkt), 0, sizeof(pkt));
 
@@ -230,12 +308,29 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 	pkt.add_device.id = htobe16(id);
 	pkt.add_device.dev_info_size = htobe16(sizeof(user_dev_));
 	pkt.add_device.dev_name_size = htobe16(sizeof(user_dev_.name));
+	// The name changes separately from the rest of the descriptor.
+	uint64_t fingerprint = fnv1a(user_dev_.name, sizeof(user_dev_.name));
+	fingerprint = fnv1a(&ne2DescriptorHash_, sizeof(ne2DescriptorHash_),
+	                    fingerprint);
+	pkt.add_device.fingerprint = htobe64(fingerprint);
+	return pkt;
+}
 
-	iov[0].iov_base = &pkt;
-	iov[0].iov_len = sizeof(pkt);
+const vector<uint8_t>&
+InDevice::ne2Descriptor()
+{
+	if (ne2Descriptor_.empty())
+		updateNE2Descriptor();
+	return ne2Descriptor_;
+}
 
-	iov[1].iov_base = user_dev_.name;
-	iov[1].iov_len = sizeof(user_dev_.name);
+// Query all the capabilities. This is the expensive part of announcing a
+// device.
+void
+InDevice::updateNE2Descriptor()
+{
+	vector<uint8_t> buf;
+	append(buf, user_dev_.name, sizeof(user_dev_.name));
 
 	struct {
 		uint16_t bustype;
@@ -248,22 +343,11 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 		htobe16(user_dev_.id.product),
 		htobe16(user_dev_.id.version),
 	};
-	iov[2].iov_base = &dev_id;
-	iov[2].iov_len = sizeof(dev_id);
+	append(buf, &dev_id, sizeof(dev_id));
 
 	uint16_t evbitsize = htobe16(evbits_.size());
-	iov[3].iov_base = &evbitsize;
-	iov[3].iov_len = sizeof(evbitsize);
-
-	iov[4].iov_base = evbits_.data();
-	iov[4].iov_len = evbits_.byte_size();
-
-	ssize_t len = 0;
-	for (const auto& i: iov)
-		len += i.iov_len;
-
-	if (::writev(fd, iov, sizeof(iov)/sizeof(iov[0])) != len)
-		throw ErrnoException("failed to write device header");
+	append(buf, &evbitsize, sizeof(evbitsize));
+	append(buf, evbits_.data(), evbits_.byte_size());
 
 	// NOTE: must not be resized, we use setBitCount here
 	Bits entrybits { 0xFFFF };
@@ -271,10 +355,6 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 	// remember available abs axis bits
 	Bits absbits;
 
-	uint16_t netbitcount;
-	iov[0].iov_base = &netbitcount;
-	iov[0].iov_len = sizeof(netbitcount);
-	iov[1].iov_base = entrybits.data();
 	for (auto ev: evbits_) {
 		// Only transfer bits which matter:
 		if (!ev || !kUISetBitIOC[ev.index()])
@@ -285,14 +365,9 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 		    entrybits.data(),
 		    "failed to query bits for event type %zu",
 		    ev.index());
-		netbitcount = htobe16(uint16_t(count));
-		iov[1].iov_len = entrybits.byte_size();
-		len = ssize_t(iov[0].iov_len + iov[1].iov_len);
-		if (::writev(fd, iov, 2) != len) {
-			throw ErrnoException(
-			    "failed to write bits for event type %zu",
-			    ev.index());
-		}
+		uint16_t netbitcount = htobe16(uint16_t(count));
+		append(buf, &netbitcount, sizeof(netbitcount));
+		append(buf, entrybits.data(), entrybits.byte_size());
 		if (ev.index() == EV_ABS)
 			absbits = entrybits.dup();
 	}
@@ -306,21 +381,26 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 		int32_t flat;
 		int32_t resolution;
 	} ai;
+	// everything but the name and the current axis values
+	uint64_t hash = fnv1a(buf.data() + sizeof(user_dev_.name),
+	                      buf.size() - sizeof(user_dev_.name));
 	for (auto abs : absbits) {
 		if (!abs)
 			continue;
 		struct input_absinfo hostai;
 		ctl(EVIOCGABS(abs.index()), &hostai,
 		    "failed to query abs axis %zu info", abs.index());
+		hash = fnv1a(&hostai.minimum,
+		             sizeof(hostai) - offsetof(struct input_absinfo,
+		                                       minimum),
+		             hash);
 		ai.value      = int32_t(htobe32(hostai.value));
 		ai.minimum    = int32_t(htobe32(hostai.minimum));
 		ai.maximum    = int32_t(htobe32(hostai.maximum));
 		ai.fuzz       = int32_t(htobe32(hostai.fuzz));
 		ai.flat       = int32_t(htobe32(hostai.flat));
 		ai.resolution = int32_t(htobe32(hostai.resolution));
-		if (!mustWrite(fd, &ai, sizeof(ai)))
-			throw ErrnoException(
-			    "failed to write absolute axis %zu", abs.index());
+		append(buf, &ai, sizeof(ai));
 	}
 
 	// The next thing in the protocol will be the state, but we currently
@@ -328,6 +408,53 @@ InDevice::writeNE2AddDevice(int fd, uint16_t id)
 	// in the future, so we send a bitfield for the types we will send the
 	// state for, which we zero out for now:
 	Bits statebits {evbits_.size()};
-	if (!mustWrite(fd, statebits.data(), statebits.byte_size()))
-		throw ErrnoException("failed to write empty state bitfield");
+	append(buf, statebits.data(), statebits.byte_size());
+
+	ne2Descriptor_ = std::move(buf);
+	ne2DescriptorHash_ = hash;
+}
+
+void
+InDevice::currentState(vector<InputEvent>& out)
+{
+	out.clear();
+	uint64_t now = nowNS(CLOCK_REALTIME);
+	InputEvent ev = {};
+	ev.tv_sec = now / 1000000000ULL;
+	ev.tv_usec = uint32_t(now % 1000000000ULL / 1000);
+
+	if (evbits_[EV_KEY]) {
+		Bits supported { KEY_MAX + 1 };
+		Bits pressed { KEY_MAX + 1 };
+		ctl(EVIOCGBIT(EV_KEY, supported.byte_size()), supported.data(),
+		    "failed to query key bits");
+		ctl(EVIOCGKEY(pressed.byte_size()), pressed.data(),
+		    "failed to query key state");
+		ev.type = EV_KEY;
+		for (auto key : supported) {
+			if (!key)
+				continue;
+			ev.code = uint16_t(key.index());
+			ev.value = pressed[key.index()] ? 1 : 0;
+			out.push_back(ev);
+		}
+	}
+
+	if (evbits_[EV_ABS]) {
+		Bits supported { ABS_MAX + 1 };
+		ctl(EVIOCGBIT(EV_ABS, supported.byte_size()), supported.data(),
+		    "failed to query abs bits");
+		ev.type = EV_ABS;
+		for (auto abs : supported) {
+			// multitouch values only make sense per slot
+			if (!abs || abs.index() >= ABS_MT_SLOT)
+				continue;
+			struct input_absinfo ai;
+			ctl(EVIOCGABS(abs.index()), &ai,
+			    "failed to query abs axis %zu info", abs.index());
+			ev.code = uint16_t(abs.index());
+			ev.value = ai.value;
+			out.push_back(ev);
+		}
+	}
 }
@@ -9,6 +9,9 @@
 #include <cstdint>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 // see main.h
 #pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
@@ -147,3 +150,172 @@ Socket::shutdown(bool read_end)
 	if (::shutdown(fd_, read_end ? SHUT_RD : SHUT_WR) != 0)
 		throw ErrnoException("shutdown() on socket failed");
 }
+
+void
+splitHostPort(const string& spec, string& host, string& port)
+{
+	size_t sep = spec.rfind(' ');
+	if (sep == string::npos && spec[0] == '[')
+		sep = spec.find(']') + 1;
+	else if (sep == string::npos)
+		sep = spec.rfind(':');
+	if (sep == string::npos || sep + 1 >= spec.length() ||
+	    (spec[sep] != ':' && spec[sep] != ' '))
+		throw MsgException("expected HOST:PORT: '%s'", spec.c_str());
+	host = spec.substr(0, sep);
+	port = spec.substr(sep + 1);
+	if (host.length() >= 2 && host[0] == '[' &&
+	    host[host.length()-1] == ']')
+		host = host.substr(1, host.length() - 2);
+}
+
+namespace {
+struct AddrInfo {
+	AddrInfo(const string& spec, int type, int flags) {
+		string host, port;
+		splitHostPort(spec, host, port);
+		struct addrinfo hints;
+		::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = type;
+		hints.ai_flags = flags;
+		int rc = ::getaddrinfo(host.empty() ? nullptr : host.c_str(),
+		                       port.c_str(), &hints, &list_);
+		if (rc != 0)
+			throw MsgException("failed to resolve %s: %s",
+			                   spec.c_str(), ::gai_strerror(rc));
+	}
+	~AddrInfo() {
+		::freeaddrinfo(list_);
+	}
+	AddrInfo(const AddrInfo&) = delete;
+
+	struct addrinfo *list_ = nullptr;
+};
+}
+
+// Bind to (passive) or connect to the first of the resolved addresses which
+// works. With SOCK_NONBLOCK in `type` connecting only gets started, so only
+// immediate errors move on to the next address.
+void
+Socket::openInet(const string& spec, int type, bool passive)
+{
+	int flags = type & SOCK_NONBLOCK;
+	AddrInfo ai(spec, type & ~SOCK_NONBLOCK, passive ? AI_PASSIVE : 0);
+	int err = 0;
+	for (auto i = ai.list_; i; i = i->ai_next) {
+		close();
+		fd_ = ::socket(i->ai_family,
+		               i->ai_socktype | SOCK_CLOEXEC | flags,
+		               i->ai_protocol);
+		if (fd_ < 0) {
+			err = errno;
+			continue;
+		}
+		if (passive) {
+			int one = 1;
+			(void)::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR,
+			                   &one, sizeof(one));
+			if (::bind(fd_, i->ai_addr, i->ai_addrlen) == 0)
+				return;
+		} else {
+			if (::connect(fd_, i->ai_addr, i->ai_addrlen) == 0 ||
+			    (flags && errno == EINPROGRESS))
+				return;
+		}
+		err = errno;
+	}
+	close();
+	errno = err;
+	throw ErrnoException("failed to %s %s",
+	                     passive ? "bind to" : "connect to", spec.c_str());
+}
+
+void
+Socket::listenTCP(const string& spec)
+{
+	openInet(spec, SOCK_STREAM, true);
+	path_ = spec;
+	listen();
+}
+
+void
+Socket::connectTCP(const string& spec)
+{
+	openInet(spec, SOCK_STREAM, false);
+	tuneTCP(fd_);
+}
+
+// Unreachable hosts give up after about 7 seconds (SYNs at 0, 1 and 3
+// seconds) instead of the kernel's default of about 2 minutes.
+static const int kTCPSynCount = 2;
+
+void
+Socket::startConnectTCP(const string& spec)
+{
+	openInet(spec, SOCK_STREAM | SOCK_NONBLOCK, false);
+	int syncnt = kTCPSynCount;
+	if (::setsockopt(fd_, IPPROTO_TCP, TCP_SYNCNT,
+	                 &syncnt, sizeof(syncnt)) != 0)
+		throw ErrnoException("failed to set tcp socket options");
+	tuneTCP(fd_);
+}
+
+// Bursts of small datagrams arrive faster than devices get created or
+// written to, and whatever does not fit into the receive buffer is lost.
+// The kernel caps this at net.core.rmem_max.
+static const int kUDPReceiveBuffer = 1024 * 1024;
+
+void
+Socket::bindUDP(const string& spec)
+{
+	openInet(spec, SOCK_DGRAM, true);
+	int rcvbuf = kUDPReceiveBuffer;
+	if (::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+		throw ErrnoException("failed to set udp receive buffer size");
+}
+
+void
+Socket::connectUDP(const string& spec)
+{
+	openInet(spec, SOCK_DGRAM, false);
+}
+
+// Every packet goes out right away, acks are not delayed, and dead peers
+// are noticed within about 20 seconds even while idle. The send buffer is
+// kept small so a slow connection fills up the daemon's output queue, where
+// the overflow policy applies, instead of piling up seconds worth of events
+// in the kernel.
+static const int kTCPSendBuffer = 32 * 1024;
+static const int kTCPKeepIdle = 10;
+static const int kTCPKeepInterval = 3;
+static const int kTCPKeepCount = 3;
+
+void
+Socket::tuneTCP(int fd)
+{
+	int one = 1;
+	int sndbuf = kTCPSendBuffer;
+	int idle = kTCPKeepIdle;
+	int interval = kTCPKeepInterval;
+	int count = kTCPKeepCount;
+	if (::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ||
+	    ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) ||
+	    ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) ||
+	    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) ||
+	    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+	                 &interval, sizeof(interval)) ||
+	    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) ||
+	    ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)))
+		throw ErrnoException("failed to set tcp socket options");
+}
+
+// The kernel clears TCP_QUICKACK again whenever it goes back to delaying
+// acks, so it has to be set after every receive for the sender's small
+// writes not to wait for an ack.
+void
+Socket::quickAck(int fd) noexcept
+{
+	int one = 1;
+	(void)::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
@@ -21,20 +21,41 @@ struct Socket {
 	template<bool Abstract> void listenUnix(const std::string& path);
 	void listen();
 	template<bool Abstract> void connectUnix(const std::string& path);
+	// HOST:PORT, [HOST]:PORT or HOST PORT. An empty host listens on all
+	// addresses.
+	void listenTCP(const std::string& spec);
+	void connectTCP(const std::string& spec);
+	// Connect without blocking: the socket becomes writable once the
+	// connection is established, or reports an error if it failed.
+	void startConnectTCP(const std::string& spec);
+	void bindUDP(const std::string& spec);
+	void connectUDP(const std::string& spec);
 	IOHandle accept();
 	void shutdown(bool read_end);
 
+	// Options for streaming small packets with low latency.
+	static void tuneTCP(int fd);
+	// Re-enable quick acks after receiving data, see tuneTCP().
+	static void quickAck(int fd) noexcept;
+
 	int      fd() const noexcept;
 	int      release() noexcept;
 	IOHandle intoIOHandle() noexcept;
 
 	operator bool() const noexcept;
 
+ private:
+	void openInet(const std::string& spec, int type, bool passive);
+
  private:
 	int fd_;
 	std::string path_;
 	bool unlink_ = false;
 };
+// Split HOST:PORT, [HOST]:PORT or HOST PORT, without the brackets.
+void splitHostPort(const std::string& spec, std::string& host,
+                   std::string& port);
+
 extern template void Socket::bindUnix<true>(const std::string& path);
 extern template void Socket::bindUnix<false>(const std::string& path);
 extern template void Socket::connectUnix<true>(const std::string& path);
@@ -0,0 +1,68 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+
+// Lock-free ring buffer for exactly one producer and one consumer thread.
+// The consumer works on the queued items in place via peek() and release().
+template<typename T>
+struct SPSCQueue {
+	SPSCQueue() = delete;
+	SPSCQueue(const SPSCQueue&) = delete;
+	// capacity must be a power of two
+	explicit SPSCQueue(size_t capacity)
+		: ring_(capacity), mask_(capacity - 1)
+	{}
+
+	// Producer: returns how many of the items fit into the queue.
+	size_t push(const T *items, size_t count) {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t head = head_.load(std::memory_order_acquire);
+		size_t space = ring_.size() - (tail - head);
+		if (count > space)
+			count = space;
+		for (size_t i = 0; i != count; ++i)
+			ring_[(tail + i) & mask_] = items[i];
+		tail_.store(tail + count, std::memory_order_release);
+		return count;
+	}
+
+	bool full() const {
+		return tail_.load(std::memory_order_relaxed) -
+		       head_.load(std::memory_order_seq_cst) == ring_.size();
+	}
+
+	// Consumer: the contiguous part of the queued items, up to where the
+	// ring wraps around.
+	Span<const T> peek() const {
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t tail = tail_.load(std::memory_order_acquire);
+		size_t start = head & mask_;
+		size_t count = tail - head;
+		if (count > ring_.size() - start)
+			count = ring_.size() - start;
+		return { ring_.data() + start, count };
+	}
+
+	void release(size_t count) {
+		head_.fetch_add(count, std::memory_order_seq_cst);
+	}
+
+ private:
+	std::vector<T> ring_;
+	size_t mask_;
+	std::atomic<size_t> head_ { 0 };
+	std::atomic<size_t> tail_ { 0 };
+};
+
+#pragma clang diagnostic pop
@@ -0,0 +1,370 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "main.h"
+
+#ifdef HAS_TLS
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <thread>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+// A peer which connects but never finishes its handshake must not block
+// `create` forever.
+static const uint64_t kHandshakeTimeout = 10 * 1000000000ULL;
+// Same as for TCP, see Socket::tuneTCP().
+static const int kRelayBuffer = 32 * 1024;
+
+static void runRelay(SSL *ssl, int net, int local);
+
+static string
+tlsError()
+{
+	unsigned long err = ERR_get_error();
+	if (!err)
+		return "connection closed";
+	char buf[256];
+	ERR_error_string_n(err, buf, sizeof(buf));
+	ERR_clear_error();
+	return buf;
+}
+
+TLSContext::TLSContext(bool server, const char *cert, const char *key,
+                       const char *ca)
+	: ctx_(SSL_CTX_new(server ? TLS_server_method() : TLS_client_method()))
+{
+	if (!ctx_)
+		throw MsgException("failed to create tls context: %s",
+		                   tlsError().c_str());
+	try {
+		struct stat st;
+		bool cadir = ::stat(ca, &st) == 0 && S_ISDIR(st.st_mode);
+		if (SSL_CTX_use_certificate_chain_file(ctx_, cert) != 1)
+			throw MsgException("failed to load certificate %s: %s",
+			                   cert, tlsError().c_str());
+		if (SSL_CTX_use_PrivateKey_file(ctx_, key,
+		                                SSL_FILETYPE_PEM) != 1 ||
+		    SSL_CTX_check_private_key(ctx_) != 1)
+			throw MsgException("failed to load private key %s: %s",
+			                   key, tlsError().c_str());
+		if (SSL_CTX_load_verify_locations(ctx_, cadir ? nullptr : ca,
+		                                  cadir ? ca : nullptr) != 1)
+			throw MsgException("failed to load CA from %s: %s",
+			                   ca, tlsError().c_str());
+	} catch (...) {
+		SSL_CTX_free(ctx_);
+		throw;
+	}
+	SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx_,
+	                   SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+	                   nullptr);
+	SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE);
+	SSL_CTX_set_app_data(ctx_, this);
+	if (server) {
+		// required to resume sessions of verified clients
+		static const unsigned char kSessionContext[] = "netevent";
+		SSL_CTX_set_session_id_context(ctx_, kSessionContext,
+		                               sizeof(kSessionContext) - 1);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx_,
+		    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx_, &TLSContext::newSession);
+	}
+}
+
+TLSContext::~TLSContext()
+{
+	for (auto& i : sessions_) {
+		if (i.second)
+			SSL_SESSION_free(i.second);
+	}
+	SSL_CTX_free(ctx_);
+}
+
+// With TLS 1.3 the tickets arrive after the handshake, on the relay thread.
+int
+TLSContext::newSession(SSL *ssl, SSL_SESSION *session)
+{
+	auto self = static_cast<TLSContext*>(
+	    SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	auto host = static_cast<const string*>(SSL_get_app_data(ssl));
+	std::lock_guard<std::mutex> lock(self->sessionsMutex_);
+	SSL_SESSION *&entry = self->sessions_[*host];
+	if (entry)
+		SSL_SESSION_free(entry);
+	entry = session;
+	return 1;
+}
+
+// A rejected certificate says more than the resulting OpenSSL error.
+static string
+handshakeError(SSL *ssl)
+{
+	long verify = SSL_get_verify_result(ssl);
+	if (verify != X509_V_OK)
+		return X509_verify_cert_error_string(verify);
+	return tlsError();
+}
+
+// Non-blocking with a deadline. A client's TCP connection may still be
+// connecting, in which case its failure shows up here.
+void
+TLSContext::handshake(SSL *ssl, int fd, bool server, const string& peer)
+{
+	if (::fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+		throw ErrnoException("failed to set up tls handshake");
+	if (SSL_set_fd(ssl, fd) != 1)
+		throw MsgException("tls setup failed: %s", tlsError().c_str());
+	if (server)
+		SSL_set_accept_state(ssl);
+	else
+		SSL_set_connect_state(ssl);
+	uint64_t deadline = nowNS(CLOCK_MONOTONIC) + kHandshakeTimeout;
+	while (true) {
+		errno = 0;
+		int rc = SSL_do_handshake(ssl);
+		if (rc == 1)
+			return;
+		struct pollfd pfd { fd, 0, 0 };
+		switch (SSL_get_error(ssl, rc)) {
+		 case SSL_ERROR_WANT_READ: pfd.events = POLLIN; break;
+		 case SSL_ERROR_WANT_WRITE: pfd.events = POLLOUT; break;
+		 case SSL_ERROR_SYSCALL:
+			if (errno && !ERR_peek_error())
+				throw MsgException(
+				    "tls connection to %s failed: %s",
+				    peer.c_str(), ::strerror(errno));
+			// fall through
+		 default:
+			throw MsgException("tls handshake with %s failed: %s",
+			                   peer.c_str(),
+			                   handshakeError(ssl).c_str());
+		}
+		uint64_t now = nowNS(CLOCK_MONOTONIC);
+		if (now >= deadline)
+			throw MsgException("tls handshake with %s timed out",
+			                   peer.c_str());
+		int ms = int((deadline - now + 999999) / 1000000);
+		if (::poll(&pfd, 1, ms) < 0 && errno != EINTR)
+			throw ErrnoException("poll() failed");
+	}
+}
+
+IOHandle
+TLSHandshake::finish(bool *resumed)
+{
+	*resumed = resumed_.get();
+	return std::move(socket_);
+}
+
+TLSHandshake
+TLSContext::connect(IOHandle tcp, const string& host)
+{
+	SSL *ssl = SSL_new(ctx_);
+	if (!ssl)
+		throw MsgException("tls setup failed: %s", tlsError().c_str());
+	try {
+		// Only the hostname or address the user gave us counts.
+		unsigned char addr[sizeof(struct in6_addr)];
+		bool ip = ::inet_pton(AF_INET, host.c_str(), addr) == 1 ||
+		          ::inet_pton(AF_INET6, host.c_str(), addr) == 1;
+		if (ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl),
+		                                       host.c_str()) != 1
+		       : (SSL_set1_host(ssl, host.c_str()) != 1 ||
+		          SSL_set_tlsext_host_name(ssl, host.c_str()) != 1))
+			throw MsgException("tls setup failed: %s",
+			                   tlsError().c_str());
+		{
+			std::lock_guard<std::mutex> lock(sessionsMutex_);
+			// map nodes stay put, see newSession()
+			auto entry = sessions_.emplace(host, nullptr).first;
+			SSL_set_app_data(ssl, &entry->first);
+			if (entry->second)
+				SSL_set_session(ssl, entry->second);
+		}
+
+		TLSHandshake pending;
+		IOHandle local;
+		pending.socket_ = relayPair(&local);
+		pending.done_ = IOHandle { ::eventfd(0, EFD_CLOEXEC |
+		                                        EFD_NONBLOCK) };
+		if (pending.done_.fd() < 0)
+			throw ErrnoException("failed to create eventfd");
+		// in case the daemon gives up on us before we are done
+		int done = ::fcntl(pending.done_.fd(), F_DUPFD_CLOEXEC, 0);
+		if (done < 0)
+			throw ErrnoException("failed to dup eventfd");
+		std::promise<bool> resumed;
+		pending.resumed_ = resumed.get_future();
+
+		auto self = shared_from_this();
+		int net = tcp.release();
+		int loc = local.release();
+		std::thread([self, ssl, net, loc, done, host]
+		            (std::promise<bool> result) {
+			bool ok = false;
+			try {
+				handshake(ssl, net, false, host);
+				result.set_value(SSL_session_reused(ssl));
+				ok = true;
+			} catch (...) {
+				result.set_exception(std::current_exception());
+			}
+			(void)::eventfd_write(done, 1);
+			::close(done);
+			if (ok)
+				runRelay(ssl, net, loc);
+			SSL_free(ssl);
+			::close(net);
+			::close(loc);
+		}, std::move(resumed)).detach();
+		return pending;
+	} catch (...) {
+		SSL_free(ssl);
+		throw;
+	}
+}
+
+IOHandle
+TLSContext::accept(IOHandle tcp)
+{
+	SSL *ssl = SSL_new(ctx_);
+	if (!ssl)
+		throw MsgException("tls setup failed: %s", tlsError().c_str());
+	try {
+		handshake(ssl, tcp.fd(), true, "client");
+		return relay(ssl, std::move(tcp));
+	} catch (...) {
+		SSL_free(ssl);
+		throw;
+	}
+}
+
+// Moves data both ways until either side is closed. Everything is
+// non-blocking, since SSL_read() and SSL_write() may each need the
+// connection to become readable or writable.
+static void
+runRelay(SSL *ssl, int net, int local)
+{
+	uint8_t up[16 * 1024], down[16 * 1024];
+	size_t upPos = 0, upLen = 0, downPos = 0, downLen = 0;
+	bool localEOF = false;
+	while (true) {
+		bool progress = false;
+		bool wantRead = false, wantWrite = false;
+
+		if (upPos == upLen && !localEOF) {
+			ssize_t got = ::read(local, up, sizeof(up));
+			if (got == 0)
+				localEOF = true;
+			else if (got < 0 && errno != EAGAIN && errno != EINTR)
+				localEOF = true;
+			else if (got > 0) {
+				upPos = 0;
+				upLen = size_t(got);
+				progress = true;
+			}
+		}
+		if (upPos < upLen) {
+			int rc = SSL_write(ssl, up + upPos, int(upLen - upPos));
+			if (rc > 0) {
+				upPos += size_t(rc);
+				progress = true;
+			} else switch (SSL_get_error(ssl, rc)) {
+			 case SSL_ERROR_WANT_READ: wantRead = true; break;
+			 case SSL_ERROR_WANT_WRITE: wantWrite = true; break;
+			 default: return;
+			}
+		} else if (localEOF) {
+			(void)SSL_shutdown(ssl);
+			return;
+		}
+
+		if (downPos == downLen) {
+			int rc = SSL_read(ssl, down, sizeof(down));
+			if (rc > 0) {
+				Socket::quickAck(net);
+				downPos = 0;
+				downLen = size_t(rc);
+				progress = true;
+			} else switch (SSL_get_error(ssl, rc)) {
+			 case SSL_ERROR_WANT_READ: wantRead = true; break;
+			 case SSL_ERROR_WANT_WRITE: wantWrite = true; break;
+			 default: return;
+			}
+		}
+		if (downPos < downLen) {
+			ssize_t put = ::send(local, down + downPos,
+			                     downLen - downPos, MSG_NOSIGNAL);
+			if (put > 0) {
+				downPos += size_t(put);
+				progress = true;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				return;
+			}
+		}
+
+		if (progress)
+			continue;
+		struct pollfd fds[2] = {
+			{ local, short((upPos == upLen ? POLLIN : 0) |
+			               (downPos < downLen ? POLLOUT : 0)), 0 },
+			{ net, short((wantRead ? POLLIN : 0) |
+			             (wantWrite ? POLLOUT : 0)), 0 },
+		};
+		if (::poll(fds, 2, -1) < 0 && errno != EINTR)
+			return;
+	}
+}
+
+// The end in *local is the relay thread's.
+IOHandle
+TLSContext::relayPair(IOHandle *local)
+{
+	int pair[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+		throw ErrnoException("socketpair() failed");
+	IOHandle ours { pair[0] };
+	IOHandle theirs { pair[1] };
+	int size = kRelayBuffer;
+	if (::setsockopt(ours.fd(), SOL_SOCKET, SO_SNDBUF,
+	                 &size, sizeof(size)) != 0 ||
+	    ::setsockopt(theirs.fd(), SOL_SOCKET, SO_SNDBUF,
+	                 &size, sizeof(size)) != 0 ||
+	    ::fcntl(ours.fd(), F_SETFL, O_NONBLOCK) != 0)
+		throw ErrnoException("failed to set up tls relay");
+	*local = std::move(ours);
+	return theirs;
+}
+
+IOHandle
+TLSContext::relay(SSL *ssl, IOHandle tcp)
+{
+	IOHandle ours;
+	IOHandle theirs = relayPair(&ours);
+	auto self = shared_from_this();
+	int net = tcp.release();
+	int local = ours.release();
+	std::thread([self, ssl, net, local]() {
+		runRelay(ssl, net, local);
+		SSL_free(ssl);
+		::close(net);
+		::close(local);
+	}).detach();
+	return theirs;
+}
+#endif
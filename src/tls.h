@@ -0,0 +1,71 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include "config.h"
+
+#ifdef HAS_TLS
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "types.h"
+#include "iohandle.h"
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+
+// TLS for tls: outputs and `create --listen=tls:`, where both sides verify the
+// other's certificate against a CA file or directory.
+// After the handshake a thread relays between the connection and one end of
+// a socketpair, the other end is returned and used like any other socket.
+
+// A client handshake running on the relay thread, so the daemon does not wait
+// for slow or unreachable hosts.
+struct TLSHandshake {
+	// readable once the handshake is done
+	int fd() const { return done_.fd(); }
+	// the connection, or throws why the handshake failed
+	IOHandle finish(bool *resumed);
+
+ private:
+	friend struct TLSContext;
+	IOHandle done_;
+	IOHandle socket_;
+	std::future<bool> resumed_;
+};
+
+struct TLSContext : std::enable_shared_from_this<TLSContext> {
+	TLSContext() = delete;
+	TLSContext(const TLSContext&) = delete;
+	TLSContext(bool server, const char *cert, const char *key,
+	           const char *ca);
+	~TLSContext();
+
+	// Clients keep the session tickets they get per host, reconnecting
+	// resumes the session with a single round trip instead of two and
+	// without the certificate checks. `tcp` may still be connecting.
+	TLSHandshake connect(IOHandle tcp, const std::string& host);
+	IOHandle accept(IOHandle tcp);
+
+ private:
+	static int newSession(SSL *ssl, SSL_SESSION *session);
+	static void handshake(SSL *ssl, int fd, bool server,
+	                      const std::string& peer);
+	static IOHandle relayPair(IOHandle *local);
+	IOHandle relay(SSL *ssl, IOHandle tcp);
+
+ private:
+	SSL_CTX *ctx_;
+	std::mutex sessionsMutex_;
+	std::map<std::string, SSL_SESSION*> sessions_;
+};
+#endif
@@ -0,0 +1,69 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdarg.h>
+#include <time.h>
+
+#include "main.h"
+
+const char*
+Exception::what() const noexcept {
+	return msg_;
+}
+
+DeviceException::DeviceException(const char *msg)
+	: Exception(msg)
+{}
+
+MsgException::MsgException(MsgException&& o)
+	: Exception(msgbuf_) // we have to copy instead of moving
+{
+	::strncpy(msgbuf_, o.msgbuf_, sizeof(msgbuf_));
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wformat-nonliteral"
+MsgException::MsgException(const char *msg, ...)
+	: Exception(msgbuf_)
+{
+	va_list ap;
+	va_start(ap, msg);
+	::vsnprintf(msgbuf_, sizeof(msgbuf_), msg, ap);
+	va_end(ap);
+}
+
+ErrnoException::ErrnoException(ErrnoException&& o)
+	: Exception(msgbuf_) // we have to copy instead of moving
+{
+	::strncpy(msgbuf_, o.msgbuf_, sizeof(msgbuf_));
+	errno_ = o.errno_;
+}
+
+ErrnoException::ErrnoException(const char *msg, ...)
+	: Exception(msgbuf_)
+{
+	errno_ = errno;
+	va_list ap;
+	va_start(ap, msg);
+	int end = ::vsnprintf(msgbuf_, sizeof(msgbuf_), msg, ap);
+	va_end(ap);
+	if (end < 0)
+		end = 0;
+	::snprintf(msgbuf_ + end,
+	           sizeof(msgbuf_)-size_t(end),
+	           ": %s", ::strerror(errno_));
+	msgbuf_[sizeof(msgbuf_)-1] = 0;
+}
+#pragma clang diagnostic pop
+
+uint64_t
+nowNS(clockid_t clock)
+{
+	struct timespec ts;
+	::clock_gettime(clock, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ULL + uint64_t(ts.tv_nsec);
+}
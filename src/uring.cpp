@@ -0,0 +1,238 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "main.h"
+
+#ifdef HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return int(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags)
+{
+	return int(::syscall(__NR_io_uring_enter, fd, to_submit,
+	                     min_complete, flags, nullptr, 0));
+}
+
+template<typename T>
+static inline T*
+ringPtr(void *base, uint32_t offset)
+{
+	return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(base) + offset);
+}
+
+URing::URing(unsigned entries)
+{
+	struct io_uring_params params;
+	::memset(&params, 0, sizeof(params));
+	fd_ = io_uring_setup(entries, &params);
+	if (fd_ < 0)
+		throw ErrnoException("failed to setup io_uring");
+
+	sqmapSize_ = params.sq_off.array
+	           + params.sq_entries * sizeof(unsigned);
+	cqmapSize_ = params.cq_off.cqes
+	           + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqmapSize_ > sqmapSize_)
+			sqmapSize_ = cqmapSize_;
+	}
+
+	sqmap_ = ::mmap(nullptr, sqmapSize_, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sqmap_ == MAP_FAILED) {
+		sqmap_ = nullptr;
+		release();
+		throw ErrnoException("failed to map io_uring submission queue");
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqmap_ = sqmap_;
+	} else {
+		cqmap_ = ::mmap(nullptr, cqmapSize_, PROT_READ | PROT_WRITE,
+		                MAP_SHARED | MAP_POPULATE, fd_,
+		                IORING_OFF_CQ_RING);
+		if (cqmap_ == MAP_FAILED) {
+			cqmap_ = nullptr;
+			release();
+			throw ErrnoException(
+			    "failed to map io_uring completion queue");
+		}
+	}
+
+	sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		release();
+		throw ErrnoException("failed to map io_uring entries");
+	}
+	sqes_ = reinterpret_cast<struct io_uring_sqe*>(sqes);
+
+	sqHead_    = ringPtr<unsigned>(sqmap_, params.sq_off.head);
+	sqTail_    = ringPtr<unsigned>(sqmap_, params.sq_off.tail);
+	sqMask_    = *ringPtr<unsigned>(sqmap_, params.sq_off.ring_mask);
+	sqEntries_ = *ringPtr<unsigned>(sqmap_, params.sq_off.ring_entries);
+	cqHead_    = ringPtr<unsigned>(cqmap_, params.cq_off.head);
+	cqTail_    = ringPtr<unsigned>(cqmap_, params.cq_off.tail);
+	cqMask_    = *ringPtr<unsigned>(cqmap_, params.cq_off.ring_mask);
+	cqes_      = ringPtr<struct io_uring_cqe>(cqmap_, params.cq_off.cqes);
+
+	// We always fill the entries in order, so the index array is static.
+	auto array = ringPtr<unsigned>(sqmap_, params.sq_off.array);
+	for (unsigned i = 0; i != sqEntries_; ++i)
+		array[i] = i;
+}
+
+URing::~URing()
+{
+	release();
+}
+
+void
+URing::release()
+{
+	if (sqes_)
+		::munmap(sqes_, sqesSize_);
+	if (cqmap_ && cqmap_ != sqmap_)
+		::munmap(cqmap_, cqmapSize_);
+	if (sqmap_)
+		::munmap(sqmap_, sqmapSize_);
+	if (fd_ != -1)
+		::close(fd_);
+	sqes_ = nullptr;
+	cqmap_ = sqmap_ = nullptr;
+	fd_ = -1;
+}
+
+struct io_uring_sqe*
+URing::getSQE()
+{
+	unsigned tail = *sqTail_;
+	if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) == sqEntries_) {
+		enter(0);
+		tail = *sqTail_;
+	}
+	auto sqe = &sqes_[tail & sqMask_];
+	::memset(sqe, 0, sizeof(*sqe));
+	// The kernel only looks at it after the tail was moved in enter().
+	*sqTail_ = tail + 1;
+	++unsubmitted_;
+	return sqe;
+}
+
+void
+URing::pollAdd(int fd, uint32_t events, uint64_t data)
+{
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = data;
+}
+
+void
+URing::read(int fd, void *buf, size_t count, uint64_t data)
+{
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = uint64_t(reinterpret_cast<uintptr_t>(buf));
+	sqe->len = uint32_t(count);
+	sqe->off = uint64_t(-1); // use the current file position
+	sqe->user_data = data;
+}
+
+void
+URing::write(int fd, const void *buf, size_t count, uint64_t data)
+{
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = uint64_t(reinterpret_cast<uintptr_t>(buf));
+	sqe->len = uint32_t(count);
+	sqe->off = uint64_t(-1);
+	sqe->user_data = data;
+}
+
+void
+URing::writev(int fd, const struct iovec *iov, unsigned count,
+              uint64_t data)
+{
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = uint64_t(reinterpret_cast<uintptr_t>(iov));
+	sqe->len = count;
+	sqe->off = uint64_t(-1);
+	sqe->user_data = data;
+}
+
+void
+URing::cancel(uint64_t target, uint64_t data)
+{
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+}
+
+void
+URing::timeout(uint64_t ns, uint64_t data)
+{
+	timeout_.tv_sec = int64_t(ns / 1000000000ULL);
+	timeout_.tv_nsec = int64_t(ns % 1000000000ULL);
+	auto sqe = getSQE();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = uint64_t(reinterpret_cast<uintptr_t>(&timeout_));
+	sqe->len = 1;
+	sqe->user_data = data;
+}
+
+void
+URing::enter(unsigned wait)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	while (true) {
+		int rc = io_uring_enter(fd_, unsubmitted_, wait,
+		                        wait ? IORING_ENTER_GETEVENTS : 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			throw ErrnoException("io_uring_enter failed");
+		}
+		unsubmitted_ -= unsigned(rc);
+		if (!unsubmitted_ || wait)
+			return;
+	}
+}
+
+bool
+URing::next(struct io_uring_cqe *out)
+{
+	unsigned head = *cqHead_;
+	if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+		return false;
+	*out = cqes_[head & cqMask_];
+	__atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+#endif
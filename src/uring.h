@@ -0,0 +1,69 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#pragma once
+
+#include "config.h"
+
+#ifdef HAS_IO_URING
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper using the raw system calls, so we don't need
+// liburing.
+struct URing {
+	URing() = delete;
+	URing(const URing&) = delete;
+	URing(unsigned entries);
+	~URing();
+
+	void pollAdd(int fd, uint32_t events, uint64_t data);
+	void read(int fd, void *buf, size_t count, uint64_t data);
+	void write(int fd, const void *buf, size_t count, uint64_t data);
+	void writev(int fd, const struct iovec *iov, unsigned count,
+	            uint64_t data);
+	void cancel(uint64_t target, uint64_t data);
+	// Completes with -ETIME after `ns` nanoseconds, so a wait for other
+	// completions can be bounded.
+	void timeout(uint64_t ns, uint64_t data);
+
+	// Submit everything prepared so far and wait for at least `wait`
+	// completions, all with a single system call.
+	void enter(unsigned wait);
+
+	// Fetch the next completion, returns false if there is none.
+	bool next(struct io_uring_cqe *out);
+
+ private:
+	struct io_uring_sqe* getSQE();
+	void release();
+
+ private:
+	int fd_ = -1;
+	void *sqmap_ = nullptr;
+	size_t sqmapSize_ = 0;
+	void *cqmap_ = nullptr;
+	size_t cqmapSize_ = 0;
+	struct io_uring_sqe *sqes_ = nullptr;
+	size_t sqesSize_ = 0;
+
+	unsigned *sqHead_;
+	unsigned *sqTail_;
+	unsigned sqMask_;
+	unsigned sqEntries_;
+	unsigned *cqHead_;
+	unsigned *cqTail_;
+	unsigned cqMask_;
+	struct io_uring_cqe *cqes_;
+
+	// prepared entries not yet handed to the kernel
+	unsigned unsubmitted_ = 0;
+	// read by the kernel when the timeout gets submitted
+	struct __kernel_timespec timeout_ = {};
+};
+#endif
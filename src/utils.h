@@ -61,10 +61,45 @@ mustWrite(int fd, const void *buf, size_t length)
 	return ::write(fd, buf, length) == ssize_t(length);
 }
 
+// Minimal non-owning view of a contiguous range, until we can use c++20's
+// std::span.
+template<typename T>
+struct Span {
+	constexpr Span() : data_(nullptr), size_(0) {}
+	constexpr Span(T *data, size_t size) : data_(data), size_(size) {}
+
+	T*     begin() const noexcept { return data_; }
+	T*     end() const noexcept { return data_ + size_; }
+	T*     data() const noexcept { return data_; }
+	size_t size() const noexcept { return size_; }
+	bool   empty() const noexcept { return !size_; }
+	T&     operator[](size_t i) const noexcept { return data_[i]; }
+
+ private:
+	T *data_;
+	size_t size_;
+};
+
 bool parseULong(unsigned long *out, const char *s, size_t maxlen);
 bool parseLong(long *out, const char *s, size_t maxlen);
 bool parseBool(bool *out, const char *s);
 
+// The current time of a clock in nanoseconds.
+uint64_t nowNS(clockid_t clock);
+
+// 64 bit FNV-1a, pass the previous result to hash data in several pieces.
+static const uint64_t kFNV1aInit = 0xcbf29ce484222325ULL;
+static inline uint64_t
+fnv1a(const void *data, size_t size, uint64_t hash = kFNV1aInit)
+{
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+	for (size_t i = 0; i != size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 template<typename Iter>
 static inline string
 join(char c, Iter&& i, Iter&& end)
@@ -277,7 +277,8 @@ OutDevice::newFromNeteventStream(int fd)
 }
 
 uniq<OutDevice>
-OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
+OutDevice::newFromNE2AddCommand(NE2Packet& pkt, const ReadFn& read,
+                                bool skip, std::vector<uint8_t>& desc)
 {
 	if (pkt.cmd != static_cast<int>(NE2Command::AddDevice))
 		throw Exception("internal error: wrong packet");
@@ -290,8 +291,18 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 		throw DeviceException(
 		    "protocol error: struct input device name size mismatch");
 
+	// Keep a copy of the raw descriptor.
+	desc.clear();
+	auto readDescriptor = [&](void *data, size_t size) {
+		if (!read(data, size))
+			return false;
+		auto bytes = reinterpret_cast<const uint8_t*>(data);
+		desc.insert(desc.end(), bytes, bytes + size);
+		return true;
+	};
+
 	::memset(&userdev, 0, sizeof(userdev));
-	if (!mustRead(fd, &userdev.name, sizeof(userdev.name)))
+	if (!readDescriptor(&userdev.name, sizeof(userdev.name)))
 		throw ErrnoException("error reading device name");
 	struct {
 		uint16_t bustype;
@@ -299,7 +310,7 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 		uint16_t product;
 		uint16_t version;
 	} dev_id;
-	if (!mustRead(fd, &dev_id, sizeof(dev_id)))
+	if (!readDescriptor(&dev_id, sizeof(dev_id)))
 		throw ErrnoException("error reading device id");
 	userdev.id.bustype = be16toh(dev_id.bustype);
 	userdev.id.vendor  = be16toh(dev_id.vendor);
@@ -314,7 +325,7 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 	};
 
 	uint16_t evbitsize = 0;
-	if (!mustRead(fd, &evbitsize, sizeof(evbitsize)))
+	if (!readDescriptor(&evbitsize, sizeof(evbitsize)))
 		throw ErrnoException("failed to read type bitfield size");
 	evbitsize = be16toh(evbitsize);
 	if (evbitsize != EV_MAX)
@@ -324,7 +335,7 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 
 	Bits evbits;
 	evbits.resize(EV_MAX);
-	if (!mustRead(fd, evbits.data(), evbits.byte_size()))
+	if (!readDescriptor(evbits.data(), evbits.byte_size()))
 		throw ErrnoException("error reading event bits");
 	if (dev) {
 		for (auto bit : evbits)
@@ -338,13 +349,13 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 		if (!ev || !kUISetBitIOC[ev.index()])
 			continue;
 		uint16_t count;
-		if (!mustRead(fd, &count, sizeof(count)))
+		if (!readDescriptor(&count, sizeof(count)))
 			throw ErrnoException(
 			    "failed to read type %zu bit count",
 			    ev.index());
 		count = be16toh(count);
 		entrybits.resize(count);
-		if (!mustRead(fd, entrybits.data(), entrybits.byte_size()))
+		if (!readDescriptor(entrybits.data(), entrybits.byte_size()))
 			throw ErrnoException(
 			    "failed to read type %zu bit field",
 			    ev.index());
@@ -375,7 +386,7 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 	for (auto abs : absbits) {
 		if (!abs)
 			continue;
-		if (!mustRead(fd, &ai, sizeof(ai)))
+		if (!readDescriptor(&ai, sizeof(ai)))
 			throw ErrnoException(
 			    "failed to read absolute axis %zu", abs.index());
 		if (!dev)
@@ -392,7 +403,7 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 
 	// Skip the state:
 	Bits statebits {EV_MAX};
-	if (!mustRead(fd, statebits.data(), statebits.byte_size()))
+	if (!readDescriptor(statebits.data(), statebits.byte_size()))
 		throw ErrnoException("failed to read state bitfield");
 	for (auto i : statebits) {
 		if (i) {
@@ -410,34 +421,125 @@ OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt, bool skip)
 void
 OutDevice::skipNE2AddCommand(int fd, NE2Packet& pkt)
 {
-	(void)newFromNE2AddCommand(fd, pkt, true);
+	std::vector<uint8_t> desc;
+	(void)newFromNE2AddCommand(pkt, [fd](void *data, size_t size) {
+		return mustRead(fd, data, size);
+	}, true, desc);
+}
+
+size_t
+OutDevice::ne2DescriptorSize(NE2Packet& pkt, Span<const uint8_t> data)
+{
+	size_t pos = 0;
+	auto read = [&](void *out, size_t size) {
+		if (data.size() - pos < size) {
+			errno = EAGAIN;
+			return false;
+		}
+		::memcpy(out, data.data() + pos, size);
+		pos += size;
+		return true;
+	};
+	std::vector<uint8_t> desc;
+	try {
+		(void)newFromNE2AddCommand(pkt, read, true, desc);
+	} catch (const ErrnoException& ex) {
+		if (ex.error() != EAGAIN)
+			throw;
+		return 0;
+	}
+	return pos;
 }
 
 uniq<OutDevice>
 OutDevice::newFromNE2AddCommand(int fd, NE2Packet& pkt)
 {
-	return newFromNE2AddCommand(fd, pkt, false);
+	std::vector<uint8_t> desc;
+	auto dev = newFromNE2AddCommand(pkt, [fd](void *data, size_t size) {
+		return mustRead(fd, data, size);
+	}, false, desc);
+	dev->ne2Descriptor_ = std::move(desc);
+	return dev;
+}
+
+uniq<OutDevice>
+OutDevice::newFromNE2Descriptor(NE2Packet& pkt, std::vector<uint8_t> desc)
+{
+	size_t pos = 0;
+	auto read = [&](void *data, size_t size) {
+		if (desc.size() - pos < size) {
+			errno = ENODATA;
+			return false;
+		}
+		::memcpy(data, desc.data() + pos, size);
+		pos += size;
+		return true;
+	};
+	std::vector<uint8_t> copy;
+	auto dev = newFromNE2AddCommand(pkt, read, false, copy);
+	if (pos != desc.size())
+		throw DeviceException("trailing data after device descriptor");
+	dev->ne2Descriptor_ = std::move(desc);
+	return dev;
 }
 
 void
-OutDevice::write(const InputEvent& ie)
+OutDevice::appendNE2AddDevice(std::vector<uint8_t>& out, uint16_t id) const
+{
+	NE2Packet pkt = {};
+	::memset(reinterpret_cast<void*>(&pkt), 0, sizeof(pkt));
+	pkt.cmd = htobe16(uint16_t(NE2Command::AddDevice));
+	pkt.add_device.id = htobe16(id);
+	pkt.add_device.dev_info_size = htobe16(sizeof(user_dev_));
+	pkt.add_device.dev_name_size = htobe16(sizeof(user_dev_.name));
+	pkt.add_device.fingerprint = htobe64(fingerprint_);
+	auto bytes = reinterpret_cast<const uint8_t*>(&pkt);
+	out.insert(out.end(), bytes, bytes + sizeof(pkt));
+	out.insert(out.end(), ne2Descriptor_.begin(), ne2Descriptor_.end());
+}
+
+bool
+OutDevice::convertEvent(struct input_event *ev, const InputEvent& ie)
 {
 	// We do not support these:
 	if (ie.type == EV_FF)
-		return;
-	struct input_event ev;
+		return false;
 
 #ifdef input_event_sec
-	ev.input_event_sec = time_t(ie.tv_sec);
-	ev.input_event_usec = ie.tv_usec;
+	ev->input_event_sec = time_t(ie.tv_sec);
+	ev->input_event_usec = ie.tv_usec;
 #else
-	ev.time.tv_sec = time_t(ie.tv_sec);
-	ev.time.tv_usec = ie.tv_usec;
+	ev->time.tv_sec = time_t(ie.tv_sec);
+	ev->time.tv_usec = ie.tv_usec;
 #endif
 
-	ev.type = ie.type;
-	ev.code = ie.code;
-	ev.value = ie.value;
-	if (!mustWrite(fd_, &ev, sizeof(ev)))
+	ev->type = ie.type;
+	ev->code = ie.code;
+	ev->value = ie.value;
+	return true;
+}
+
+Span<const struct input_event>
+OutDevice::queue(const InputEvent& ie)
+{
+	if (!convertEvent(&frame_[frameLength_], ie))
+		return {};
+	++frameLength_;
+	// SYN_MT_REPORT only separates the contacts within a frame.
+	bool end = ie.type == EV_SYN && ie.code == SYN_REPORT;
+	if (!end && frameLength_ != kMaxFrameLength)
+		return {};
+	size_t length = frameLength_;
+	frameLength_ = 0;
+	return { frame_, length };
+}
+
+void
+OutDevice::write(const InputEvent& ie)
+{
+	auto frame = queue(ie);
+	if (frame.empty())
+		return;
+	if (!mustWrite(fd_, frame.data(), frame.size() * sizeof(frame[0])))
 		throw ErrnoException("failed to write event");
 }
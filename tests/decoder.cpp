@@ -0,0 +1,126 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdio.h>
+
+#include "src/decoder.h"
+#include "src/ne3.h"
+
+// set up by main() in netevent itself, the decoder does not need it
+unsigned long kUISetBitIOC[EV_MAX] = {0};
+
+// Streams get split at arbitrary points, the decoder has to hand out the
+// same events no matter where.
+
+struct Decoded {
+	uint16_t id;
+	InputEvent ev;
+};
+
+static std::vector<InputEvent>
+makeFrame(uint64_t usec, int32_t value)
+{
+	std::vector<InputEvent> frame;
+	const uint16_t codes[][2] = {
+		{ EV_REL, REL_X }, { EV_REL, REL_Y }, { EV_KEY, BTN_LEFT },
+		{ EV_SYN, SYN_REPORT },
+	};
+	for (auto& c : codes) {
+		InputEvent ev;
+		ev.tv_sec = usec / 1000000;
+		ev.tv_usec = uint32_t(usec % 1000000);
+		ev.type = c[0];
+		ev.code = c[1];
+		ev.value = c[0] == EV_SYN ? 0 : value;
+		frame.push_back(ev);
+		usec += 3;
+		value = -value * 300;
+	}
+	return frame;
+}
+
+static bool
+drain(NE2Decoder& decoder, std::vector<Decoded>& out)
+{
+	NE2Packet pkt = {};
+	Span<const uint8_t> descriptor;
+	while (decoder.next(&pkt, &descriptor)) {
+		if (be16toh(pkt.cmd) != uint16_t(NE2Command::DeviceEvent)) {
+			::fprintf(stderr, "unexpected packet %u\n",
+			          be16toh(pkt.cmd));
+			return false;
+		}
+		pkt.event.event.toHost();
+		out.push_back({ be16toh(pkt.event.id), pkt.event.event });
+		if (out.size() > 1000) {
+			::fprintf(stderr, "too many events\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+feed(NE2Decoder& decoder, const std::vector<uint8_t>& data, size_t from,
+     size_t to)
+{
+	auto space = decoder.space();
+	::memcpy(space.data(), data.data() + from, to - from);
+	decoder.filled(to - from);
+}
+
+static bool
+same(const Decoded& a, const Decoded& b)
+{
+	return a.id == b.id &&
+	       a.ev.tv_sec == b.ev.tv_sec && a.ev.tv_usec == b.ev.tv_usec &&
+	       a.ev.type == b.ev.type && a.ev.code == b.ev.code &&
+	       a.ev.value == b.ev.value;
+}
+
+static bool
+testNE3Splits()
+{
+	std::vector<uint8_t> stream;
+	std::vector<Decoded> expected;
+	for (uint16_t id = 1; id != 4; ++id) {
+		auto frame = makeFrame(1700000000999990ULL + id * 7, id * 37);
+		encodeNE3Frame(stream, id, { frame.data(), frame.size() });
+		for (auto& ev : frame)
+			expected.push_back({ id, ev });
+	}
+
+	for (size_t split = 0; split <= stream.size(); ++split) {
+		NE2Decoder decoder;
+		decoder.version(kNE3Version);
+		std::vector<Decoded> got;
+		feed(decoder, stream, 0, split);
+		if (!drain(decoder, got))
+			return false;
+		feed(decoder, stream, split, stream.size());
+		if (!drain(decoder, got))
+			return false;
+		bool ok = got.size() == expected.size();
+		for (size_t i = 0; ok && i != got.size(); ++i)
+			ok = same(got[i], expected[i]);
+		if (!ok) {
+			::fprintf(stderr, "ne3 frames split at %zu of %zu:"
+			          " got %zu of %zu events\n", split,
+			          stream.size(), got.size(), expected.size());
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+main()
+{
+	bool ok = testNE3Splits();
+	::printf("%s: decoder\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
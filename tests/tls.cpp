@@ -0,0 +1,308 @@
+/*
+ * netevent - low-level event-device sharing
+ *
+ * Copyright (C) 2017-2021 Wolfgang Bumiller <wry.git@bumiller.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdio.h>
+
+#include "src/main.h"
+#include "src/tls.h"
+
+// set up by main() in netevent itself, TLS does not need it
+unsigned long kUISetBitIOC[EV_MAX] = {0};
+
+#ifdef HAS_TLS
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+// Two connections over loopback: the first one does the full handshake with
+// both certificates checked against the CA, the second one resumes its
+// session. Data has to make it through the relay threads both ways. A client
+// trusting a different CA must be turned away. The certificates are made up
+// on the fly so they cannot expire.
+
+static EVP_PKEY*
+newKey()
+{
+	EVP_PKEY *key = nullptr;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	if (ctx && EVP_PKEY_keygen_init(ctx) == 1 &&
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+	                                           NID_X9_62_prime256v1) == 1)
+		(void)EVP_PKEY_keygen(ctx, &key);
+	EVP_PKEY_CTX_free(ctx);
+	return key;
+}
+
+static bool
+addExtension(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+	X509V3_CTX v3;
+	X509V3_set_ctx_nodb(&v3);
+	X509V3_set_ctx(&v3, issuer, cert, nullptr, nullptr, 0);
+	X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &v3, nid,
+	                                          const_cast<char*>(value));
+	bool ok = ext && X509_add_ext(cert, ext, -1) == 1;
+	X509_EXTENSION_free(ext);
+	return ok;
+}
+
+// Self-signed CA certificate if there is no issuer.
+static X509*
+newCert(EVP_PKEY *key, const char *cn, X509 *issuer, EVP_PKEY *issuerKey)
+{
+	static long serial = 1;
+	X509 *cert = X509_new();
+	if (!cert)
+		return nullptr;
+	X509_NAME *name = X509_get_subject_name(cert);
+	ASN1_INTEGER *number = X509_get_serialNumber(cert);
+	bool ok = X509_set_version(cert, 2) == 1 &&
+	          ASN1_INTEGER_set(number, serial++) == 1 &&
+	          X509_gmtime_adj(X509_getm_notBefore(cert), -60) &&
+	          X509_gmtime_adj(X509_getm_notAfter(cert), 3600) &&
+	          X509_set_pubkey(cert, key) == 1 &&
+	          X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	              reinterpret_cast<const unsigned char*>(cn),
+	              -1, -1, 0) == 1 &&
+	          X509_set_issuer_name(cert, issuer
+	              ? X509_get_subject_name(issuer) : name) == 1;
+	if (ok && !issuer)
+		ok = addExtension(cert, cert, NID_basic_constraints,
+		                  "critical,CA:TRUE") &&
+		     addExtension(cert, cert, NID_key_usage,
+		                  "critical,keyCertSign");
+	else if (ok)
+		ok = addExtension(cert, issuer, NID_subject_alt_name,
+		                  "IP:127.0.0.1");
+	if (ok)
+		ok = X509_sign(cert, issuer ? issuerKey : key,
+		               EVP_sha256()) != 0;
+	if (!ok) {
+		X509_free(cert);
+		return nullptr;
+	}
+	return cert;
+}
+
+struct Files {
+	Files() {
+		char tmpl[] = "/tmp/netevent-tls.XXXXXX";
+		if (::mkdtemp(tmpl))
+			dir_ = tmpl;
+	}
+	~Files() {
+		for (auto& path : paths_)
+			(void)::unlink(path.c_str());
+		if (!dir_.empty())
+			(void)::rmdir(dir_.c_str());
+	}
+
+	// Returns the path of the new file, or an empty string.
+	string write(const char *name, X509 *cert, EVP_PKEY *key) {
+		if (dir_.empty() || (!cert && !key))
+			return {};
+		string path = dir_ + "/" + name;
+		FILE *file = ::fopen(path.c_str(), "w");
+		if (!file)
+			return {};
+		paths_.push_back(path);
+		bool ok = cert ? PEM_write_X509(file, cert) == 1
+		               : PEM_write_PrivateKey(file, key, nullptr,
+		                                      nullptr, 0, nullptr,
+		                                      nullptr) == 1;
+		if (::fclose(file) != 0 || !ok)
+			return {};
+		return path;
+	}
+
+ private:
+	string dir_;
+	std::vector<string> paths_;
+};
+
+struct Identity {
+	string cert;
+	string key;
+};
+
+// A certificate signed by the CA for each side, or empty paths.
+static bool
+makeCerts(Files& files, const char *prefix, string *ca,
+          Identity *server, Identity *client)
+{
+	string name = prefix;
+	EVP_PKEY *caKey = newKey();
+	EVP_PKEY *serverKey = newKey();
+	EVP_PKEY *clientKey = newKey();
+	X509 *caCert = nullptr, *serverCert = nullptr, *clientCert = nullptr;
+	if (caKey && serverKey && clientKey) {
+		caCert = newCert(caKey, "netevent test ca", nullptr, nullptr);
+		serverCert = newCert(serverKey, "server", caCert, caKey);
+		clientCert = newCert(clientKey, "client", caCert, caKey);
+	}
+	*ca = files.write((name + "ca.pem").c_str(), caCert, nullptr);
+	server->cert = files.write((name + "server.pem").c_str(),
+	                           serverCert, nullptr);
+	server->key = files.write((name + "server.key").c_str(),
+	                          nullptr, serverKey);
+	client->cert = files.write((name + "client.pem").c_str(),
+	                           clientCert, nullptr);
+	client->key = files.write((name + "client.key").c_str(),
+	                          nullptr, clientKey);
+	X509_free(caCert);
+	X509_free(serverCert);
+	X509_free(clientCert);
+	EVP_PKEY_free(caKey);
+	EVP_PKEY_free(serverKey);
+	EVP_PKEY_free(clientKey);
+	return !ca->empty() && !server->cert.empty() &&
+	       !server->key.empty() && !client->cert.empty() &&
+	       !client->key.empty();
+}
+
+static IOHandle
+listenLoopback(struct sockaddr_in *addr)
+{
+	IOHandle sock { ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+	::memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(*addr);
+	auto sa = reinterpret_cast<struct sockaddr*>(addr);
+	if (!sock || ::bind(sock.fd(), sa, len) != 0 ||
+	    ::listen(sock.fd(), 4) != 0 ||
+	    ::getsockname(sock.fd(), sa, &len) != 0)
+		throw ErrnoException("failed to listen on loopback");
+	return sock;
+}
+
+// Sends `what` from one end and expects it on the other.
+static bool
+transfer(const IOHandle& from, const IOHandle& to, const char *what)
+{
+	size_t len = ::strlen(what);
+	char buf[64] = {};
+	if (!mustWrite(from.fd(), what, len) ||
+	    !mustRead(to.fd(), buf, len) || ::memcmp(buf, what, len) != 0)
+	{
+		::fprintf(stderr, "tls relay lost \"%s\"\n", what);
+		return false;
+	}
+	return true;
+}
+
+// Returns whether the handshake succeeded, *resumed tells how.
+static bool
+connectLoopback(const std::shared_ptr<TLSContext>& server,
+                const std::shared_ptr<TLSContext>& client,
+                const IOHandle& listener, const struct sockaddr_in& addr,
+                bool *resumed)
+{
+	IOHandle tcp { ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+	if (!tcp || ::connect(tcp.fd(),
+	                      reinterpret_cast<const struct sockaddr*>(&addr),
+	                      sizeof(addr)) != 0)
+		throw ErrnoException("failed to connect to loopback");
+	TLSHandshake pending = client->connect(std::move(tcp), "127.0.0.1");
+
+	IOHandle ours;
+	try {
+		ours = server->accept(IOHandle {
+			::accept4(listener.fd(), nullptr, nullptr,
+			          SOCK_CLOEXEC)
+		});
+	} catch (const Exception&) {
+	}
+
+	struct pollfd pfd { pending.fd(), POLLIN, 0 };
+	if (::poll(&pfd, 1, 15000) != 1)
+		throw Exception("client tls handshake did not finish");
+	IOHandle theirs;
+	try {
+		theirs = pending.finish(resumed);
+	} catch (const Exception&) {
+		return false;
+	}
+	if (!ours)
+		return false;
+	// The server talks first, so with TLS 1.3 the client has its session
+	// ticket before the next connection.
+	return transfer(ours, theirs, "ping") &&
+	       transfer(theirs, ours, "pong");
+}
+
+static bool
+testLoopback()
+{
+	Files files;
+	string ca, otherCA;
+	Identity server, client, otherServer, otherClient;
+	if (!makeCerts(files, "", &ca, &server, &client) ||
+	    !makeCerts(files, "other-", &otherCA, &otherServer, &otherClient))
+	{
+		::fprintf(stderr, "failed to create test certificates\n");
+		return false;
+	}
+
+	auto serverCtx = std::make_shared<TLSContext>(
+	    true, server.cert.c_str(), server.key.c_str(), ca.c_str());
+	auto clientCtx = std::make_shared<TLSContext>(
+	    false, client.cert.c_str(), client.key.c_str(), ca.c_str());
+	auto strangerCtx = std::make_shared<TLSContext>(
+	    false, otherClient.cert.c_str(), otherClient.key.c_str(),
+	    otherCA.c_str());
+
+	struct sockaddr_in addr;
+	IOHandle listener = listenLoopback(&addr);
+	bool resumed = true;
+	if (!connectLoopback(serverCtx, clientCtx, listener, addr, &resumed) ||
+	    resumed)
+	{
+		::fprintf(stderr, "first tls connection failed%s\n",
+		          resumed ? " (claims to be resumed)" : "");
+		return false;
+	}
+	if (!connectLoopback(serverCtx, clientCtx, listener, addr, &resumed) ||
+	    !resumed)
+	{
+		::fprintf(stderr, "second tls connection was not resumed\n");
+		return false;
+	}
+	if (connectLoopback(serverCtx, strangerCtx, listener, addr, &resumed)) {
+		::fprintf(stderr, "tls client trusting another ca"
+		                  " was accepted\n");
+		return false;
+	}
+	return true;
+}
+
+int
+main()
+{
+	bool ok;
+	try {
+		ok = testLoopback();
+	} catch (const Exception& ex) {
+		::fprintf(stderr, "%s\n", ex.what());
+		ok = false;
+	}
+	::printf("%s: tls\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+#else
+int
+main()
+{
+	::printf("skipped: tls (built without tls support)\n");
+	return 0;
+}
+#endif